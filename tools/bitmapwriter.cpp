@@ -0,0 +1,132 @@
+#include "bitmapwriter.h"
+#include "pagerender.h"
+#include "workerpool.h"
+#include "phasetimes.h"
+
+// max number of bitmaps waiting for every I/O thread
+static const int QUEUE_PER_THREAD = 256;
+
+const char* symbol_kind_names[SymbolKindsCount] = { "lib", "img", "non_symb", "page" };
+
+bool BMPStore::store(mdjvu_bitmap_t bitmap, const SymbolKey& /*key*/, const std::string& filename, int32 dpi, mdjvu_error_t* perr)
+{
+    return mdjvu_save_bmp(bitmap, filename.c_str(), dpi, perr);
+}
+
+bool BMPStore::storePage(mdjvu_image_t page, const SymbolKey& /*key*/, const std::string& filename, int32 dpi, mdjvu_error_t* perr)
+{
+    return save_page_bmp(page, filename.c_str(), dpi, perr);
+}
+
+bool BitmapStore::storePage(mdjvu_image_t page, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr)
+{
+    mdjvu_bitmap_t bitmap = mdjvu_render(page);
+    const bool res = store(bitmap, key, filename, dpi, perr);
+    mdjvu_bitmap_destroy(bitmap);
+    return res;
+}
+
+BitmapWriter::BitmapWriter(BitmapStore* store, int io_threads): m_store(store), m_pool(NULL), m_errors(0), m_first_error(NULL), m_store_time(0)
+{
+    if (io_threads > 0) {
+        m_pool = new WorkerPool(io_threads, io_threads * QUEUE_PER_THREAD);
+    }
+}
+
+BitmapWriter::~BitmapWriter()
+{
+    delete m_pool;
+}
+
+void BitmapWriter::save(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi, bool take_ownership)
+{
+    if (!m_store) {
+        if (take_ownership) {
+            mdjvu_bitmap_destroy(bitmap);
+        }
+        return;
+    }
+    if (!m_pool) {
+        write(bitmap, key, filename, dpi);
+        if (take_ownership) {
+            mdjvu_bitmap_destroy(bitmap);
+        }
+        return;
+    }
+
+    mdjvu_bitmap_t own = take_ownership ? bitmap : mdjvu_bitmap_clone(bitmap);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued[key.form]++;
+    }
+    m_pool->submit([this, own, key, filename, dpi] {
+        write(own, key, filename, dpi);
+        mdjvu_bitmap_destroy(own);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_queued[key.form] == 0) {
+            m_queued.erase(key.form);
+            m_written.notify_all();
+        }
+    });
+}
+
+void BitmapWriter::waitForm(int32 form)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_written.wait(lock, [this, form] { return !m_queued.count(form); });
+}
+
+void BitmapWriter::savePage(mdjvu_image_t page, const SymbolKey& key, const std::string& filename, int32 dpi)
+{
+    if (!m_store) {
+        return;
+    }
+    mdjvu_error_t err = NULL;
+    Stopwatch timer;
+    const bool ok = m_store->storePage(page, key, filename, dpi, &err);
+    account(ok, err, filename, timer.elapsed());
+}
+
+void BitmapWriter::write(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi)
+{
+    mdjvu_error_t err = NULL;
+    Stopwatch timer;
+    const bool ok = m_store->store(bitmap, key, filename, dpi, &err);
+    account(ok, err, filename, timer.elapsed());
+}
+
+void BitmapWriter::account(bool ok, mdjvu_error_t err, const std::string& filename, double time)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_store_time += time;
+    if (!ok && !m_errors++) {
+        m_first_error = err ? err : mdjvu_get_error(mdjvu_error_fopen_write);
+        m_failed_file = filename;
+    }
+}
+
+double BitmapWriter::storeTime()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_store_time;
+}
+
+int BitmapWriter::flush(mdjvu_error_t* perr, std::string* failed_file)
+{
+    if (m_pool) {
+        m_pool->wait();
+    }
+    mdjvu_error_t err = NULL;
+    if (m_store && !m_store->finish(&err)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_errors++) {
+            m_first_error = err ? err : mdjvu_get_error(mdjvu_error_fopen_write);
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_errors) {
+        if (perr) *perr = m_first_error;
+        if (failed_file) *failed_file = m_failed_file;
+    }
+    return m_errors;
+}
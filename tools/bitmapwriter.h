@@ -0,0 +1,89 @@
+#ifndef BITMAPWRITER_H
+#define BITMAPWRITER_H
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+class WorkerPool;
+
+// Kind of saved bitmap, same as prefix of its file name
+enum SymbolKind
+{
+    SymbolLib,      // lib_N.bmp - added to library
+    SymbolImg,      // img_N.bmp - drawn on image only
+    SymbolNonSymb,  // non_symb_N.bmp - non-symbol data
+    SymbolPage,     // page.bmp - rendered page
+    SymbolKindsCount
+};
+
+extern const char* symbol_kind_names[SymbolKindsCount];
+
+struct SymbolKey
+{
+    int32 form;     // DIRM entry
+    SymbolKind kind;
+    int32 id;
+};
+
+// Output backend of bitmaps. May be called from several threads.
+class BitmapStore
+{
+public:
+    virtual ~BitmapStore() {}
+    virtual bool store(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr) = 0;
+    // rendered page, by default the whole page is rendered and stored
+    virtual bool storePage(mdjvu_image_t page, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr);
+    virtual bool finish(mdjvu_error_t* /*perr*/) { return true; }
+};
+
+// Directory tree of BMP files
+class BMPStore: public BitmapStore
+{
+public:
+    bool store(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr);
+    // streamed by bands, the page bitmap isn't created
+    bool storePage(mdjvu_image_t page, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr);
+};
+
+// Passes bitmaps to the store. With I/O threads the decoder hands a bitmap
+// over to a bounded queue and goes on decoding while files are created.
+// Without threads bitmaps are stored immediately.
+// Without store bitmaps are dropped (stats-only run).
+class BitmapWriter
+{
+public:
+    explicit BitmapWriter(BitmapStore* store, int io_threads = 0);
+    ~BitmapWriter();
+
+    // Bitmap is cloned if it's stored later, unless take_ownership is set
+    // (then the writer destroys it).
+    void save(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi, bool take_ownership = false);
+    // Renders and stores page in the calling thread: blits of the page
+    // refer to shared dictionary bitmaps which may be freed after return.
+    void savePage(mdjvu_image_t page, const SymbolKey& key, const std::string& filename, int32 dpi);
+    // waits until all queued bitmaps are written and finishes the store.
+    // Returns number of failed writes and first error.
+    int flush(mdjvu_error_t* perr = NULL, std::string* failed_file = NULL);
+    // waits until queued bitmaps of the form (SymbolKey::form) are written
+    void waitForm(int32 form);
+    // total time spent in the store, by all threads
+    double storeTime();
+private:
+    void write(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi);
+    void account(bool ok, mdjvu_error_t err, const std::string& filename, double time);
+
+    BitmapStore* m_store;
+    WorkerPool* m_pool;
+    std::mutex m_mutex;
+    int m_errors;
+    mdjvu_error_t m_first_error;
+    std::string m_failed_file;
+    double m_store_time;
+    std::map<int32, int> m_queued; // bitmaps waiting for I/O threads by form
+    std::condition_variable m_written;
+};
+
+#endif // BITMAPWRITER_H
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <vector>
 
 #include "bsdecoder.h"
 
@@ -74,7 +75,7 @@ private:
 
 // blocksort -- the main entry point
 
-static void blocksort(unsigned char *data, int size, int &markerpos)
+void bs_blocksort(unsigned char *data, int size, int &markerpos)
 {
     _BSort bsort(data, size);
     bsort.run(markerpos);
@@ -840,11 +841,32 @@ unsigned int BSDecoder::decode()
 
     if (markerpos<1 || markerpos>=size) return 0;
 //      G_THROW( ERR_MSG("ByteStream.corrupt") );
-    // Allocate pointers
-    unsigned int *posn = (unsigned int*) ::operator new(sizeof(unsigned int) * blocksize);
-    memset(posn, 0, sizeof(unsigned int)*size);
+    if (!bs_unsort(data, size, markerpos, unsort))
+        return 0;
+//      G_THROW( ERR_MSG("ByteStream.corrupt") );
+    return size;
+}
+
+// Inverse transform.
+// The walk through posn is a chain of dependent loads that miss the cache
+// on large blocks. So it is cut in segments that start at positions marked
+// in posn, and BS_CURSORS segments are walked together. A segment goes to its
+// own part of buf.segments until it reaches the start of another one or the
+// marker. When the part is full, the segment ends and a new one starts there.
+// At last the segments are copied to data in order of the chain.
+enum { BS_CURSORS=32, BS_SEGMENTS=5*BS_CURSORS, BS_MARK=0x800000, BS_RANK=0x7fffff,
+       BS_MINCURSORBLOCK=0x10000 };
+
+bool bs_unsort(unsigned char *data, int size, int markerpos, BSUnsortBuffers &buf)
+{
+    if (markerpos<1 || markerpos>=size)
+        return false;
+    if ((int)buf.posn.size() < size)
+        buf.posn.resize(size);
+    unsigned int *posn = buf.posn.data();
     // Prepare count buffer
     int count[256];
+    int i;
     for (i=0; i<256; i++)
       count[i] = 0;
     // Fill count buffer
@@ -854,6 +876,7 @@ unsigned int BSDecoder::decode()
         posn[i] = (c<<24) | (count[c] & 0xffffff);
         count[c] += 1;
       }
+    posn[markerpos] = 0;
     for (i=markerpos+1; i<size; i++)
       {
         unsigned char c = data[i];
@@ -871,26 +894,92 @@ unsigned int BSDecoder::decode()
     // Undo the sort transform
     i = 0;
     last = size-1;
-    while (last>0)
+    if (size < BS_MINCURSORBLOCK || size > BS_RANK)
       {
-        unsigned int n = posn[i];
-        unsigned char c = (posn[i]>>24);
-        data[--last] = c;
-        i = count[c] + (n & 0xffffff);
+        while (last>0)
+          {
+            unsigned int n = posn[i];
+            unsigned char c = (posn[i]>>24);
+            data[--last] = c;
+            i = count[c] + (n & 0xffffff);
+          }
+        return i == markerpos;
+      }
+    // Segments start at 0, where the plain walk starts, and evenly after it.
+    // Every cursor has at most one part that isn't full, so there are
+    // less than size/part + BS_CURSORS <= BS_SEGMENTS segments
+    const int part = size / (BS_SEGMENTS - BS_CURSORS) + 1;
+    if ((int)buf.segments.size() < part * BS_SEGMENTS)
+      buf.segments.resize(part * BS_SEGMENTS);
+    unsigned char *out = buf.segments.data();
+    int start[BS_SEGMENTS], end[BS_SEGMENTS], len[BS_SEGMENTS];
+    int cur[BS_CURSORS], seg[BS_CURSORS];
+    int k;
+    for (k=0; k<BS_CURSORS; k++)
+      {
+        start[k] = (int)((long long)size * k / BS_CURSORS);
+        if (start[k] == markerpos)
+          start[k] = markerpos+1;
+        cur[k] = start[k];
+        seg[k] = k;
+        len[k] = 0;
+        posn[start[k]] |= BS_MARK;
+      }
+    posn[markerpos] |= BS_MARK;
+    int segments = BS_CURSORS;
+    int active = BS_CURSORS;
+    while (active > 0)
+      {
+        for (k=0; k<BS_CURSORS; k++)
+          {
+            int s = seg[k];
+            if (s < 0)
+              continue;
+            unsigned int n = posn[cur[k]];
+            if (len[s] > 0 && (n & BS_MARK))
+              {
+                end[s] = cur[k];
+                seg[k] = -1;
+                active--;
+                continue;
+              }
+            if (len[s] == part)
+              {
+                end[s] = cur[k];
+                posn[cur[k]] |= BS_MARK;
+                s = seg[k] = segments++;
+                start[s] = cur[k];
+                len[s] = 0;
+              }
+            unsigned char c = (n>>24);
+            out[s*part + len[s]++] = c;
+            cur[k] = count[c] + (n & BS_RANK);
+          }
+      }
+    // Copy the segments in order of the chain
+    int s = 0;
+    for (;;)
+      {
+        if (len[s] > last)
+          return false;
+        const unsigned char *p = out + s*part;
+        for (int j=0; j<len[s]; j++)
+          data[--last] = p[j];
+        i = end[s];
+        if (i == markerpos)
+          return last == 0;
+        for (s=0; s<segments && start[s] != i; s++)
+          ;
+        if (s == segments)
+          return false;
       }
-    // Free and check
-    ::operator delete(posn);
-    if (i != markerpos)
-        return 0;
-//      G_THROW( ERR_MSG("ByteStream.corrupt") );
-    return size;
 }
 
 // ========================================
 // --- Construction
 
 BSDecoder::BSDecoder(FILE *f, int len)
-        : offset(0), bptr(0), blocksize(0), size(0), data(NULL), eof(false), gzp(f, len)
+        : offset(0), bptr(0), blocksize(0), size(0), data(NULL), eof(false), len(len), gzp(f, len)
 {
     // Initialize context array
     memset(ctx, 0, sizeof(ctx));
@@ -5,7 +5,21 @@
 
 #ifndef MDJVU_BSDECODER_H
 #define MDJVU_BSDECODER_H
-#include "../src/jb2/zp.h"
+#include "zpstream.h"
+#include <vector>
+
+// Block sort stages, also used by djvudict-bench.
+// Forward transform (encoder side), data[size-1] must be 0 (end marker)
+void bs_blocksort(unsigned char *data, int size, int &markerpos);
+// Scratch buffers of the inverse transform, kept for the next blocks
+struct BSUnsortBuffers
+{
+    std::vector<unsigned int> posn;      // symbol and rank of every position
+    std::vector<unsigned char> segments; // segments of the multi-cursor walk
+};
+// Inverse transform of size bytes with end marker at markerpos,
+// original data goes to data[0..size-2]. Returns false on corrupted block
+bool bs_unsort(unsigned char *data, int size, int markerpos, BSUnsortBuffers &buf);
 
 class BSDecoder
 {
@@ -18,6 +32,8 @@ class BSDecoder
         unsigned int decode(void);
         
         size_t read(void *buffer, size_t sz);       
+        // compressed bytes read from the stream
+        inline int consumed(void) const { return zp_consumed_bytes(gzp, len); }
     private:
 
         // Data
@@ -26,7 +42,9 @@ class BSDecoder
         unsigned int   blocksize;
         int             size;
         unsigned char  *data;
+        BSUnsortBuffers unsort;
         bool            eof;
+        int             len;
         
         // Decoder
         ZPDecoder gzp;
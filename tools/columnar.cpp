@@ -0,0 +1,260 @@
+#include "columnar.h"
+#include <string.h>
+
+static const char COLUMNS_MAGIC[] = "DJDCOL01";
+static const char COLUMNS_INDEX_MAGIC[] = "DJDCIDX1";
+
+struct ColumnDef
+{
+    const char* name;
+    ColumnType type;
+};
+
+enum { FormsPosition, FormsEntryName, FormsType, FormsPathToDump, FormsColumns };
+
+static const ColumnDef forms_columns[FormsColumns] = {
+    { "position", ColumnInt32 },
+    { "entry_name", ColumnString },
+    { "type", ColumnUInt8 },        // 0 - not known, 1 - sjbz, 2 - djbz
+    { "path_to_dump", ColumnString }
+};
+
+enum { SjbzForm, SjbzDjbzForm, SjbzWidth, SjbzHeight, SjbzDpi, SjbzVersion, SjbzColumns };
+
+static const ColumnDef sjbz_columns[SjbzColumns] = {
+    { "form", ColumnInt32 },
+    { "djbz_form", ColumnInt32 },
+    { "width", ColumnInt32 },
+    { "height", ColumnInt32 },
+    { "dpi", ColumnInt32 },
+    { "version", ColumnInt32 }
+};
+
+enum { LetterForm, LetterLocalId, LetterX, LetterY, LetterWidth, LetterHeight,
+       LetterInImage, LetterInLibrary, LetterIsNonSymbol, LetterRefForm, LetterRefLocalId,
+       LetterIsRefinement, LetterFilename, LetterCompressedBits, LetterIndexBits,
+       LetterBitmapHash, LetterColumns };
+
+static const ColumnDef letters_columns[LetterColumns] = {
+    { "form", ColumnInt32 },
+    { "local_id", ColumnInt32 },
+    { "x", ColumnInt32 },
+    { "y", ColumnInt32 },
+    { "width", ColumnInt32 },
+    { "height", ColumnInt32 },
+    { "in_image", ColumnUInt8 },
+    { "in_library", ColumnUInt8 },
+    { "is_non_symbol", ColumnUInt8 },
+    { "ref_form", ColumnInt32 },
+    { "ref_local_id", ColumnInt32 },
+    { "is_refinement", ColumnUInt8 },
+    { "filename", ColumnString },
+    { "compressed_bits", ColumnFloat64 },
+    { "index_bits", ColumnFloat64 },
+    { "bitmap_hash", ColumnUInt64 }  // 0 if bitmaps aren't stored (see -format sql)
+};
+
+static const struct { const char* name; const ColumnDef* columns; int count; }
+tables[ColumnarWriter::TablesCount] = {
+    { "forms", forms_columns, FormsColumns },
+    { "sjbz_info", sjbz_columns, SjbzColumns },
+    { "letters", letters_columns, LetterColumns }
+};
+
+static void put_uint16(std::vector<unsigned char>& buf, uint16 v)
+{
+    buf.push_back(v & 0xFF);
+    buf.push_back(v >> 8);
+}
+
+static void put_uint32(std::vector<unsigned char>& buf, uint32 v)
+{
+    for (int i = 0; i < 4; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static void put_uint64(std::vector<unsigned char>& buf, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static void put_float64(std::vector<unsigned char>& buf, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_uint64(buf, bits);
+}
+
+static void put_name(std::vector<unsigned char>& buf, const char* name)
+{
+    const size_t len = strlen(name);
+    put_uint16(buf, len);
+    buf.insert(buf.end(), name, name + len);
+}
+
+// Columns of a chunk. A string column keeps its end offsets in
+// the column buffer and the bytes aside until the chunk is written.
+class ColumnChunk
+{
+public:
+    explicit ColumnChunk(int columns): m_columns(columns), m_strings(columns) {}
+
+    inline void putInt32(int c, int32 v) { put_uint32(m_columns[c], v); }
+    inline void putUInt8(int c, int v) { m_columns[c].push_back(v); }
+    inline void putFloat64(int c, double v) { put_float64(m_columns[c], v); }
+    inline void putUInt64(int c, uint64_t v) { put_uint64(m_columns[c], v); }
+    inline void putString(int c, const char* s)
+    {
+        if (s) m_strings[c].insert(m_strings[c].end(), s, s + strlen(s));
+        put_uint32(m_columns[c], m_strings[c].size());
+    }
+
+    const std::vector< std::vector<unsigned char> >& columns()
+    {
+        for (size_t c = 0; c < m_columns.size(); c++) {
+            m_columns[c].insert(m_columns[c].end(), m_strings[c].begin(), m_strings[c].end());
+            std::vector<unsigned char>().swap(m_strings[c]);
+        }
+        return m_columns;
+    }
+private:
+    std::vector< std::vector<unsigned char> > m_columns;
+    std::vector< std::vector<unsigned char> > m_strings;
+};
+
+/* ========================================================================= */
+
+ColumnarWriter::ColumnarWriter(): m_f(NULL), m_pos(0), m_failed(false) {}
+
+ColumnarWriter::~ColumnarWriter()
+{
+    if (m_f) {
+        fclose(m_f);
+    }
+}
+
+bool ColumnarWriter::open(const std::string& filename, mdjvu_error_t* perr)
+{
+    m_f = fopen(filename.c_str(), "wb");
+    if (!m_f || fwrite(COLUMNS_MAGIC, 1, 8, m_f) != 8) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    m_pos = 8;
+    return true;
+}
+
+bool ColumnarWriter::writeChunk(Table table, uint32 rows, const std::vector< std::vector<unsigned char> >& columns)
+{
+    if (m_failed) {
+        return false;
+    }
+    ChunkInfo info = { (unsigned char) table, rows, m_pos };
+    std::vector<unsigned char> size;
+    for (size_t c = 0; c < columns.size(); c++) {
+        size.clear();
+        put_uint64(size, columns[c].size());
+        if (fwrite(size.data(), 1, size.size(), m_f) != size.size() ||
+                fwrite(columns[c].data(), 1, columns[c].size(), m_f) != columns[c].size()) {
+            m_failed = true;
+            return false;
+        }
+        m_pos += size.size() + columns[c].size();
+    }
+    m_chunks.push_back(info);
+    return true;
+}
+
+bool ColumnarWriter::addForm(int position, const char* entry_name, const char* dump_path, const FormRecord& rec)
+{
+    if (!m_f) {
+        return false;
+    }
+    m_form_positions[entry_name] = position;
+
+    ColumnChunk form(FormsColumns);
+    form.putInt32(FormsPosition, position);
+    form.putString(FormsEntryName, entry_name);
+    form.putUInt8(FormsType, rec.type);
+    form.putString(FormsPathToDump, dump_path);
+    writeChunk(TableForms, 1, form.columns());
+
+    int djbz_form = rec.type == 2 ? position : -1;
+    if (rec.type == 1) {
+        if (rec.djbz_name) {
+            std::unordered_map<std::string, int>::const_iterator it = m_form_positions.find(rec.djbz_name);
+            if (it != m_form_positions.end()) {
+                djbz_form = it->second;
+            }
+        }
+        ColumnChunk sjbz(SjbzColumns);
+        sjbz.putInt32(SjbzForm, position);
+        sjbz.putInt32(SjbzDjbzForm, djbz_form);
+        sjbz.putInt32(SjbzWidth, rec.w);
+        sjbz.putInt32(SjbzHeight, rec.h);
+        sjbz.putInt32(SjbzDpi, rec.dpi);
+        sjbz.putInt32(SjbzVersion, rec.version);
+        writeChunk(TableSjbzInfo, 1, sjbz.columns());
+    }
+
+    if (!rec.letters.empty()) {
+        ColumnChunk letters(LetterColumns);
+        for (const FormRecord::Letter& l: rec.letters) {
+            letters.putInt32(LetterForm, position);
+            letters.putInt32(LetterLocalId, l.local_id);
+            letters.putInt32(LetterX, l.x);
+            letters.putInt32(LetterY, l.y);
+            letters.putInt32(LetterWidth, l.w);
+            letters.putInt32(LetterHeight, l.h);
+            letters.putUInt8(LetterInImage, l.to_image);
+            letters.putUInt8(LetterInLibrary, l.to_library);
+            letters.putUInt8(LetterIsNonSymbol, l.is_non_symbol);
+            letters.putInt32(LetterRefForm, l.ref_local_id == -1 ? -1 : l.from_djbz ? djbz_form : position);
+            letters.putInt32(LetterRefLocalId, l.ref_local_id);
+            letters.putUInt8(LetterIsRefinement, l.is_refinement);
+            letters.putString(LetterFilename, l.filename.c_str());
+            letters.putFloat64(LetterCompressedBits, l.bits);
+            letters.putFloat64(LetterIndexBits, l.index_bits);
+            letters.putUInt64(LetterBitmapHash, l.bitmap_hash);
+        }
+        writeChunk(TableLetters, rec.letters.size(), letters.columns());
+    }
+    return !m_failed;
+}
+
+bool ColumnarWriter::finish(mdjvu_error_t* perr)
+{
+    if (!m_f) {
+        return true;
+    }
+
+    std::vector<unsigned char> buf;
+    const uint64_t schema_offset = m_pos;
+    buf.push_back(TablesCount);
+    for (int t = 0; t < TablesCount; t++) {
+        put_name(buf, tables[t].name);
+        put_uint16(buf, tables[t].count);
+        for (int c = 0; c < tables[t].count; c++) {
+            put_name(buf, tables[t].columns[c].name);
+            buf.push_back(tables[t].columns[c].type);
+        }
+    }
+    const uint64_t index_offset = schema_offset + buf.size();
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        buf.push_back(m_chunks[i].table);
+        put_uint32(buf, m_chunks[i].rows);
+        put_uint64(buf, m_chunks[i].offset);
+    }
+    put_uint64(buf, schema_offset);
+    put_uint64(buf, index_offset);
+    put_uint32(buf, m_chunks.size());
+    buf.insert(buf.end(), COLUMNS_INDEX_MAGIC, COLUMNS_INDEX_MAGIC + 8);
+
+    const bool ok = !m_failed && fwrite(buf.data(), 1, buf.size(), m_f) == buf.size();
+    const bool closed = fclose(m_f) == 0;
+    m_f = NULL;
+    if (!ok || !closed) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include "formrecord.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ * Columnar export of forms, sjbz_info and letters (columns.djdcol), the same
+ * data as in SQLite tables but readable column by column without row scans.
+ * Rows of every DIRM entry are appended as soon as the entry is committed.
+ * All integers are little-endian.
+ *
+ *   header:  "DJDCOL01"
+ *   chunks:  rows of one table from one entry, column after column:
+ *            uint64 size of column data, then the data:
+ *              int32, uint8, float64, uint64 - one value per row,
+ *              string - uint32 end offset of every row, then the bytes
+ *   schema:  uint8 tables count, for every table: uint16 name length, name,
+ *            uint16 columns count, for every column: uint16 name length,
+ *            name, uint8 type (ColumnType)
+ *   chunks index: for every chunk: uint8 table, uint32 rows, uint64 offset
+ *   footer:  uint64 schema offset, uint64 chunks index offset,
+ *            uint32 chunks count, "DJDCIDX1"
+ *
+ * Forms are referred to by their position in DIRM (forms.position),
+ * -1 is NULL. A reference of a letter is (ref_form, ref_local_id).
+ */
+
+enum ColumnType
+{
+    ColumnInt32 = 1,
+    ColumnUInt8,
+    ColumnFloat64,
+    ColumnUInt64,
+    ColumnString
+};
+
+class ColumnarWriter
+{
+public:
+    enum Table { TableForms, TableSjbzInfo, TableLetters, TablesCount };
+
+    ColumnarWriter();
+    ~ColumnarWriter();
+
+    bool open(const std::string& filename, mdjvu_error_t* perr);
+    inline bool isOpen() const { return m_f != NULL; }
+    // writes chunks of the entry, false if file can't be written
+    bool addForm(int position, const char* entry_name, const char* dump_path, const FormRecord& rec);
+    // writes schema and index and closes the file
+    bool finish(mdjvu_error_t* perr);
+private:
+    bool writeChunk(Table table, uint32 rows, const std::vector< std::vector<unsigned char> >& columns);
+
+    struct ChunkInfo
+    {
+        unsigned char table; // Table
+        uint32 rows;
+        uint64_t offset;
+    };
+
+    FILE* m_f;
+    uint64_t m_pos;
+    bool m_failed;
+    std::vector<ChunkInfo> m_chunks;
+    std::unordered_map<std::string, int> m_form_positions; // by entry name
+};
+
+#endif // COLUMNAR_H
@@ -0,0 +1,255 @@
+#include "dictcache.h"
+#include "pathutils.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include "../src/jb2/jb2coder.h"
+
+#if (defined(windows) || defined(WIN32))
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+static const char DICT_CACHE_MAGIC[] = "DJDDICT2";
+
+#define RECORD_SIZE (7 * 4 + 1 + 2 * 8)
+
+static void put_uint32(std::vector<unsigned char>& buf, uint32 v)
+{
+    for (int i = 0; i < 4; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static void put_uint64(std::vector<unsigned char>& buf, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static void put_float64(std::vector<unsigned char>& buf, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_uint64(buf, bits);
+}
+
+static uint32 get_uint32(const unsigned char* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32) p[3] << 24;
+}
+
+static uint64_t get_uint64(const unsigned char* p)
+{
+    return (uint64_t) get_uint32(p) | (uint64_t) get_uint32(p + 4) << 32;
+}
+
+static double get_float64(const unsigned char* p)
+{
+    const uint64_t bits = get_uint64(p);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+void DictTrace::dictionary(const JB2Form& /*form*/, int32 /*shared_count*/)
+{
+    m_cacheable = false;
+}
+
+void DictTrace::record(const JB2Form& /*form*/, const JB2Record& rec)
+{
+    switch (rec.type) {
+    case jb2_start_of_image:
+    case jb2_new_symbol_add_to_library_only:
+    case jb2_matched_symbol_with_refinement_add_to_library_only:
+    case jb2_require_dictionary_or_reset:
+    case jb2_comment:
+    case jb2_end_of_data:
+        break;
+    default: // the dictionary draws on its image, replay can't restore it
+        m_cacheable = false;
+        return;
+    }
+    // the first record requires a shared dictionary
+    if (rec.type == jb2_require_dictionary_or_reset && m_records.empty()) {
+        m_cacheable = false;
+        return;
+    }
+    if (!m_cacheable) {
+        return;
+    }
+    JB2Record r = rec;
+    r.bitmap = NULL;
+    r.filename = "";
+    m_records.push_back(r);
+}
+
+bool DictCache::open(const std::string& dir, mdjvu_error_t* perr)
+{
+    if (mkpath(dir)) {
+        fprintf(stderr, "Can't create %s\n", dir.c_str());
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    m_dir = dir;
+    return true;
+}
+
+// FNV-1a
+uint64_t DictCache::key(const unsigned char* data, uint32 length)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (uint32 i = 0; i < length; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::string DictCache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.djbzc", (unsigned long long) key);
+    return get_statsname(m_dir, name);
+}
+
+bool DictCache::load(uint64_t key, const unsigned char* chunk, uint32 length, DictTrace* trace, mdjvu_image_t* image,
+                     std::vector<mdjvu_bitmap_t>* bitmaps) const
+{
+    FILE* f = fopen(path(key).c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    const unsigned char* p = data.data();
+    const unsigned char* end = p + data.size();
+    // the chunk itself guards against collisions of the hash
+    if (data.size() < 20 + (size_t) length + 4 || memcmp(p, DICT_CACHE_MAGIC, 8) ||
+            get_uint64(p + 8) != key || get_uint32(p + 16) != length ||
+            memcmp(p + 20, chunk, length)) {
+        return false;
+    }
+    p += 20 + length;
+    const uint32 records = get_uint32(p);
+    p += 4;
+    if ((size_t) (end - p) < (size_t) records * RECORD_SIZE + 4) {
+        return false;
+    }
+    std::vector<JB2Record>& res = trace->records();
+    res.clear();
+    res.reserve(records);
+    uint32 library = 0;
+    for (uint32 i = 0; i < records; i++, p += RECORD_SIZE) {
+        JB2Record r;
+        r.type = (int32) get_uint32(p);
+        r.local_id = (int32) get_uint32(p + 4);
+        r.x = (int32) get_uint32(p + 8);
+        r.y = (int32) get_uint32(p + 12);
+        r.w = (int32) get_uint32(p + 16);
+        r.h = (int32) get_uint32(p + 20);
+        r.match = (int32) get_uint32(p + 24);
+        const unsigned char flags = p[28];
+        r.new_bitmap = flags & 1;
+        r.from_shared = (flags & 2) != 0;
+        r.non_symbol = (flags & 4) != 0;
+        r.to_library = (flags & 8) != 0;
+        r.to_image = (flags & 16) != 0;
+        r.bits = get_float64(p + 29);
+        r.index_bits = get_float64(p + 37);
+        r.bitmap = NULL;
+        r.filename = "";
+        r.image_index = -1;
+        if (r.to_library) library++;
+        res.push_back(r);
+    }
+
+    if (get_uint32(p) != library) {
+        return false;
+    }
+    p += 4;
+    bitmaps->clear();
+    mdjvu_image_t img = mdjvu_image_create(0, 0);
+    for (uint32 i = 0; i < library; i++) {
+        if (end - p < 8) {
+            mdjvu_image_destroy(img);
+            return false;
+        }
+        const int32 w = (int32) get_uint32(p);
+        const int32 h = (int32) get_uint32(p + 4);
+        p += 8;
+        const int32 row_size = (w + 7) >> 3;
+        if (w < 0 || h < 0 || (size_t) (end - p) < (size_t) row_size * h) {
+            mdjvu_image_destroy(img);
+            return false;
+        }
+        mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(w, h);
+        for (int32 y = 0; y < h; y++, p += row_size) {
+            memcpy(mdjvu_bitmap_access_packed_row(bitmap, y), p, row_size);
+        }
+        mdjvu_image_add_bitmap(img, bitmap);
+        bitmaps->push_back(bitmap);
+    }
+    *image = img;
+    return true;
+}
+
+bool DictCache::store(uint64_t key, const unsigned char* chunk, uint32 length, const DictTrace& trace,
+                      const mdjvu_bitmap_t* bitmaps, int32 count) const
+{
+    std::vector<unsigned char> buf(DICT_CACHE_MAGIC, DICT_CACHE_MAGIC + 8);
+    put_uint64(buf, key);
+    put_uint32(buf, length);
+    buf.insert(buf.end(), chunk, chunk + length);
+    const std::vector<JB2Record>& records = trace.records();
+    put_uint32(buf, records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        const JB2Record& r = records[i];
+        put_uint32(buf, r.type);
+        put_uint32(buf, r.local_id);
+        put_uint32(buf, r.x);
+        put_uint32(buf, r.y);
+        put_uint32(buf, r.w);
+        put_uint32(buf, r.h);
+        put_uint32(buf, r.match);
+        buf.push_back((r.new_bitmap ? 1 : 0) | (r.from_shared ? 2 : 0) | (r.non_symbol ? 4 : 0) |
+                      (r.to_library ? 8 : 0) | (r.to_image ? 16 : 0));
+        put_float64(buf, r.bits);
+        put_float64(buf, r.index_bits);
+    }
+    put_uint32(buf, count);
+    for (int32 i = 0; i < count; i++) {
+        const int32 w = mdjvu_bitmap_get_width(bitmaps[i]);
+        const int32 h = mdjvu_bitmap_get_height(bitmaps[i]);
+        const int32 row_size = (w + 7) >> 3;
+        put_uint32(buf, w);
+        put_uint32(buf, h);
+        for (int32 y = 0; y < h; y++) {
+            const unsigned char* row = mdjvu_bitmap_access_packed_row(bitmaps[i], y);
+            buf.insert(buf.end(), row, row + row_size);
+        }
+    }
+
+    const std::string name = path(key);
+    // unique for threads and processes writing the same dictionary
+    static std::atomic<unsigned> serial(0);
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int) getpid(), serial++);
+    const std::string tmp_name = name + suffix;
+    FILE* f = fopen(tmp_name.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    const bool written = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    if (fclose(f) || !written || rename(tmp_name.c_str(), name.c_str())) {
+        remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef DICTCACHE_H
+#define DICTCACHE_H
+
+#include "jb2visitor.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Folder of decoded shared dictionaries (-dict-cache), a file per Djbz named
+ * by a 64-bit hash of the raw chunk. A file keeps records of the dictionary
+ * (without shapes) and the bitmaps it adds, so a dump of the dictionary is
+ * replayed without decoding. The raw chunk is kept too and compared before
+ * a replay, so neither a hash collision nor a foreign file in a shared
+ * folder gives wrong bitmaps. All integers are little-endian.
+ *
+ *   "DJDDICT2", uint64 key, uint32 chunk length, the chunk,
+ *   uint32 records count, for every record:
+ *     int32 type, local_id, x, y, w, h, match, uint8 flags (to_image,
+ *     to_library, non_symbol, from_shared, new_bitmap from the low bit),
+ *     float64 bits, index_bits
+ *   uint32 bitmaps count, for every bitmap: int32 w, h, packed rows
+ *     ((w+7)/8 bytes per row, the leftmost pixel in the high bit)
+ */
+
+// Records of a dictionary while it's decoded. Only dictionaries with
+// library records and without shared dictionary of their own are cached.
+class DictTrace: public JB2Visitor
+{
+public:
+    DictTrace(): m_cacheable(true) {}
+    void dictionary(const JB2Form& form, int32 shared_count);
+    void record(const JB2Form& form, const JB2Record& rec);
+
+    inline bool cacheable() const { return m_cacheable; }
+    // bitmap and filename are not kept
+    inline const std::vector<JB2Record>& records() const { return m_records; }
+    inline std::vector<JB2Record>& records() { return m_records; }
+private:
+    std::vector<JB2Record> m_records;
+    bool m_cacheable;
+};
+
+class DictCache
+{
+public:
+    bool open(const std::string& dir, mdjvu_error_t* perr);
+    inline bool isOpen() const { return !m_dir.empty(); }
+
+    static uint64_t key(const unsigned char* data, uint32 length);
+    // bitmaps of library records in their order, a new *image owns them.
+    // data is the Djbz chunk, it has to match the stored one.
+    bool load(uint64_t key, const unsigned char* data, uint32 length, DictTrace* trace, mdjvu_image_t* image,
+              std::vector<mdjvu_bitmap_t>* bitmaps) const;
+    // files are written under a temporary name and renamed, so several
+    // processes may share the folder
+    bool store(uint64_t key, const unsigned char* data, uint32 length, const DictTrace& trace,
+               const mdjvu_bitmap_t* bitmaps, int32 count) const;
+
+private:
+    std::string path(uint64_t key) const;
+
+    std::string m_dir;
+};
+
+#endif // DICTCACHE_H
@@ -13,100 +13,15 @@
 #include <locale.h>
 #include "config.h"
 #include "djvudict_options.h"
-#include "djvudirreader.h"
-#include "jb2dumper.h"
+#include "djvudump.h"
+#include "packarchive.h"
+#include "selection.h"
 #ifdef HAVE_LIBSQLITE3
 #include <sqlite3.h>
 #endif
 
 Options options;
 
-const char *link_to_filename(const char *path_to_djvu) {
-    int32 pos = strlen(path_to_djvu);
-    while (pos > 0 && path_to_djvu[pos] != '/' && path_to_djvu[pos] != '\\') pos--;
-    return path_to_djvu + pos +1;
-}
-
-uint32 dump_djvu_dict(const char *djvu_filepath, const char *out_path, mdjvu_error_t *perr)
-{
-    if (perr) {
-        *perr = NULL;
-    }
-
-    FILE *f = fopen(djvu_filepath, "rb");
-    if (!f) {
-        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
-        return 0;
-    }
-
-    uint32 id = read_uint32_most_significant_byte_first(f);
-    if (id != CHUNK_ID_AT_AND_T)
-    {
-        fprintf(stderr, "No AT&T tag found.\n");
-        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
-        return 0;
-    }
-
-    IFFChunk FORM;
-    get_child_chunk(f, &FORM, NULL);
-    if (!find_sibling_chunk(f, &FORM, CHUNK_ID_FORM))
-    {
-        fprintf(stderr, "No FORM tag found.\n");
-        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
-        return 0;
-    }
-
-    id = read_uint32_most_significant_byte_first(f);
-    if (id == ID_DJVU)
-    { // single-page DjVu
-        DIRM_Entry single_page;
-        single_page.size = FORM.length;
-        single_page.type = Page;
-        // should be FORM start
-        single_page.offset = ftell(f) - 8 /*FORM header*/ - 4 /*DJVU tag*/;
-        const char flags = 0x81; // 0b10000001;
-        single_page.str_flags = &flags;
-        single_page.id_str = link_to_filename(djvu_filepath);
-        single_page.name_str = NULL;
-        single_page.title_str = NULL;
-
-        JB2Dumper dumper;
-        dumper.dumpMultiPage(f, &single_page, 1, out_path, perr, &options);
-    } else if (id == ID_DJVM)
-    { // multi-page DjVu
-        IFFChunk DIRM;
-        get_child_chunk(f, &DIRM, &FORM);
-        if (DIRM.id != ID_DIRM) {
-            fprintf(stderr, "No DIRM tag found.\n");
-            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
-            return 0;
-        }
-
-        DjVuDirReader dir;
-        int readed_len = dir.decode(f, DIRM.length - DIRM.skipped, perr, &options);
-        skip_in_chunk(&DIRM, readed_len);
-        if (DIRM.length % 2) {
-            fseek(f, 1, SEEK_CUR); // align file pos
-        }
-        if (*perr || !readed_len) {
-            fprintf(stderr, "No DIRM tag found.\n");
-            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
-            return 0;
-        }
-        JB2Dumper dumper;
-        dumper.dumpMultiPage(f, dir.entries(), dir.count(), out_path, perr, &options);
-
-    } else {
-        fprintf(stderr, "No DJVU or DJVM tag found.\n");
-        if (perr) *perr = mdjvu_get_error(mdjvu_error_wrong_djvu_type);
-        return 0;
-    }
-
-
-    fclose(f);
-    return 1;
-}
-
 #define DICT_DUMPER_VERSION "0.0.2"
 
 static void show_usage_and_exit(void)           /* {{{ */
@@ -115,23 +30,54 @@ static void show_usage_and_exit(void)           /* {{{ */
     printf("djvudict %s - %s\n", DICT_DUMPER_VERSION, what_it_does);
     printf(_("Usage:\n"));
     printf(_("    djvudict [options] <input file> <output folder>\n"));
+    printf(_("    djvudict [options] - <output folder> (document is read from stdin)\n"));
+    printf(_("    djvudict [options] -batch <output folder> <input files, patterns or @list file>\n"));
+    printf(_("    djvudict -unpack <symbols.pack> <output folder>\n"));
     printf(_("Formats supported:\n"));
     printf(_("    DjVu (single-page), DjVu (bundled multi-page)\n"));
     printf(_("Options:\n"));
     printf(_("    -v, -verbose:           verbose output\n"));
+    printf(_("    -j, -jobs <n>:          dump pages in n threads (0 - by number of CPUs)\n"));
+    printf(_("    -io-threads <n>:        save bitmaps in n background threads (default 0)\n"));
+    printf(_("    -max-dict-memory <Mb>:  with jobs, delay decoding of shared dictionaries over this size\n"));
+    printf(_("    -incremental:           dump only entries changed since the previous run into the folder\n"));
+    printf(_("    -resume:                continue an interrupted run from its last checkpoint (same as -incremental)\n"));
+    printf(_("    -dict-cache <folder>:   reuse shared dictionaries decoded by previous runs\n"));
+    printf(_("    -pages <ranges>:        dump only these pages (from 1) and their dictionaries, e.g. 500-520,600\n"));
+    printf(_("    -entries <ranges>:      dump only these DIRM entries (from 0, as in folder names)\n"));
+    printf(_("    -m, -manifest:          list shared dictionary bitmaps used by page in manifest.log\n"));
+    printf(_("    -f, -format <dir|pack>: save bitmaps as BMP files (default) or to single symbols.pack\n"));
+#ifdef HAVE_LIBSQLITE3
+    printf(_("    -f, -format sql:        save distinct bitmaps to SQLite3 database, no BMP files\n"));
+#endif
+    printf(_("    -stats-only:            only decode and write stats.log files, no bitmaps\n"));
+    printf(_("    -i, -inventory:         list entries, page sizes and chunk sizes without decoding\n"));
+    printf(_("    -c, -columns:           export forms and letters to columnar columns.djdcol\n"));
 #ifdef HAVE_LIBSQLITE3
     printf(_("    -s, -sql:               save document structure to SQLite3 database file\n"));
+    printf(_("    -sql-direct:            write the database directly on disk (WAL), memory use stays flat\n"));
+    printf(_("    -sql-cache <Mb>:        page cache of -sql-direct mode (default 64)\n"));
 #endif
     exit(2);
 }                   /* }}} */
 
 static int decide_if_djvu(const char *path)
 {
-    return mdjvu_ends_with_ignore_case(path, ".djvu")
+    return !strcmp(path, "-") // stdin
+        || mdjvu_ends_with_ignore_case(path, ".djvu")
         || mdjvu_ends_with_ignore_case(path, ".djv");
 }
 
 
+static void check_ranges(const char* ranges)
+{
+    RangeSelection selection;
+    if (!selection.parse(ranges)) {
+        fprintf(stderr, _("Error: wrong ranges: %s\n"), ranges);
+        exit(2);
+    }
+}
+
 /* same_option(foo, "opt") returns 1 in three cases:
  *
  *      foo is "o" (first letter of opt)
@@ -146,41 +92,164 @@ static int same_option(const char *option, const char *s)
     return 0;
 }
 
-int main(int argc, char **argv)
+// options are argv[1] .. argv[end - 1]
+static void parse_options(char **argv, int end)
 {
-    //int arg_start;
-    setlocale(LC_ALL, "");
-
-    if (argc < 3 || !decide_if_djvu(argv[argc-2])) {
-        show_usage_and_exit();
-        return 0;
-    }
-
     options.verbose = options.save_to_sql = 0;
-    int i;
-    for (i = 1; i < argc-2 && argv[i][0] == '-'; i++) {
+    options.sql_direct = 0;
+    options.sql_cache_mb = 64;
+    options.jobs = 1;
+    options.io_threads = 0;
+    options.write_manifest = 0;
+    options.output_format = OutputDir;
+    options.stats_only = 0;
+    options.write_columns = 0;
+    options.inventory = 0;
+    options.max_dict_memory_mb = 0;
+    options.dict_cache = NULL;
+    options.incremental = 0;
+    options.pages = NULL;
+    options.entries = NULL;
+    for (int i = 1; i < end && argv[i][0] == '-'; i++) {
         char *option = argv[i] + 1;
         if (same_option(option, "verbose")) {
             options.verbose = 1;
+        } else if (same_option(option, "jobs")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.jobs = atoi(argv[++i]);
+            if (options.jobs < 0) {
+                fprintf(stderr, _("Error: wrong number of jobs: %s\n"), argv[i]);
+                exit(2);
+            }
+        } else if (!strcmp(option, "io-threads") || !strcmp(option, "-io-threads")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.io_threads = atoi(argv[++i]);
+            if (options.io_threads < 0) {
+                fprintf(stderr, _("Error: wrong number of I/O threads: %s\n"), argv[i]);
+                exit(2);
+            }
+        } else if (!strcmp(option, "max-dict-memory") || !strcmp(option, "-max-dict-memory")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.max_dict_memory_mb = atoi(argv[++i]);
+            if (options.max_dict_memory_mb <= 0) {
+                fprintf(stderr, _("Error: wrong dictionary memory size: %s\n"), argv[i]);
+                exit(2);
+            }
+        } else if (!strcmp(option, "incremental") || !strcmp(option, "-incremental") ||
+                   !strcmp(option, "resume") || !strcmp(option, "-resume")) {
+            options.incremental = 1;
+        } else if (!strcmp(option, "dict-cache") || !strcmp(option, "-dict-cache")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.dict_cache = argv[++i];
+        } else if (!strcmp(option, "pages") || !strcmp(option, "-pages")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.pages = argv[++i];
+            check_ranges(options.pages);
+        } else if (!strcmp(option, "entries") || !strcmp(option, "-entries")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.entries = argv[++i];
+            check_ranges(options.entries);
+        } else if (same_option(option, "manifest")) {
+            options.write_manifest = 1;
+        } else if (same_option(option, "format")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            const char* format = argv[++i];
+            if (!strcmp(format, "dir")) {
+                options.output_format = OutputDir;
+            } else if (!strcmp(format, "pack")) {
+                options.output_format = OutputPack;
+            } else if (!strcmp(format, "sql")) {
+                options.output_format = OutputSQL;
+                options.save_to_sql = 1;
+            } else {
+                fprintf(stderr, _("Error: unknown output format: %s\n"), format);
+                exit(2);
+            }
+        } else if (same_option(option, "inventory")) {
+            options.inventory = 1;
+        } else if (same_option(option, "columns")) {
+            options.write_columns = 1;
+        } else if (!strcmp(option, "stats-only") || !strcmp(option, "-stats-only")) {
+            options.stats_only = 1;
         } else if (same_option(option, "sql")) {
-#ifdef HAVE_LIBSQLITE3
             options.save_to_sql = 1;
-            int res = sqlite3_initialize();
-            if (SQLITE_OK != res) {
-                fprintf(stderr, _("Error: can't initialize SQLITE3 library (code %d)\n"), res);
+        } else if (!strcmp(option, "sql-direct") || !strcmp(option, "-sql-direct")) {
+            options.save_to_sql = 1;
+            options.sql_direct = 1;
+        } else if (!strcmp(option, "sql-cache") || !strcmp(option, "-sql-cache")) {
+            if (i + 1 >= end) show_usage_and_exit();
+            options.sql_cache_mb = atoi(argv[++i]);
+            if (options.sql_cache_mb <= 0) {
+                fprintf(stderr, _("Error: wrong SQLite cache size: %s\n"), argv[i]);
                 exit(2);
             }
-#else
-            fprintf(stderr, _("Warning: The \"-sql\" option is found, but the application is build withou SQL support. The option is ignored\n"));
-#endif
         } else {
             fprintf(stderr, _("unknown option: %s\n"), argv[i]);
             exit(2);
         }
     }
+}
+
+int main(int argc, char **argv)
+{
+    //int arg_start;
+    setlocale(LC_ALL, "");
+
+    if (argc == 4 && !strcmp(argv[1], "-unpack")) {
+        mdjvu_error_t perr = NULL;
+        if (!unpack_archive(argv[2], argv[3], &perr)) {
+            if (perr) fprintf(stderr, "%s", mdjvu_get_error_message(perr));
+            exit(1);
+        }
+        return 0;
+    }
+
+    // djvudict [options] -batch <output folder> <inputs...>
+    int batch = 0;
+    for (int i = 1; i < argc && !batch; i++) {
+        if (!strcmp(argv[i], "-batch") || !strcmp(argv[i], "--batch")) {
+            batch = i;
+        }
+    }
+    if (batch) {
+        if (batch + 2 >= argc) {
+            show_usage_and_exit();
+        }
+        parse_options(argv, batch);
+    } else {
+        if (argc < 3 || !decide_if_djvu(argv[argc-2])) {
+            show_usage_and_exit();
+            return 0;
+        }
+        parse_options(argv, argc - 2);
+    }
+
+    if (options.save_to_sql) {
+#ifdef HAVE_LIBSQLITE3
+        int res = sqlite3_initialize();
+        if (SQLITE_OK != res) {
+            fprintf(stderr, _("Error: can't initialize SQLITE3 library (code %d)\n"), res);
+            exit(2);
+        }
+#else
+        fprintf(stderr, _("Warning: The \"-sql\" option is found, but the application is build withou SQL support. The option is ignored\n"));
+        options.save_to_sql = 0;
+        if (options.output_format == OutputSQL) {
+            options.output_format = OutputDir;
+        }
+#endif
+    }
+
+    if (batch) {
+        const uint32 res = dump_djvu_batch(argv + batch + 2, argc - batch - 2, argv[batch + 1], &options);
+#ifdef HAVE_LIBSQLITE3
+        sqlite3_shutdown();
+#endif
+        return res ? 0 : 1;
+    }
 
     mdjvu_error_t perr;
-    if (!dump_djvu_dict(argv[argc-2], argv[argc-1], &perr)) {
+    if (!dump_djvu_dict(argv[argc-2], argv[argc-1], &perr, &options)) {
         fprintf(stderr, "%s", mdjvu_get_error_message(perr));
         exit(1);
     }
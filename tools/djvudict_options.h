@@ -1,10 +1,31 @@
 #ifndef DJVUDICTOPTIONS_H
 #define DJVUDICTOPTIONS_H
 
+enum OutputFormat
+{
+    OutputDir,  // tree of BMP files
+    OutputPack, // single symbols.pack archive
+    OutputSQL   // bitmaps table of SQLite database (implies -sql)
+};
+
 typedef struct Options
 {
     int verbose;
     int save_to_sql;
+    int sql_direct; // write SQLite database on disk (WAL) instead of in memory + backup
+    int sql_cache_mb; // page cache of direct SQLite mode, Mb
+    int jobs; // number of threads dumping pages, 0 - by number of CPUs
+    int io_threads; // number of threads saving bitmaps, 0 - save in place
+    int write_manifest; // list shared dictionary files used by page in manifest.log
+    int output_format; // OutputFormat
+    int write_columns; // columnar export of forms and letters to columns.djdcol
+    int stats_only; // collect counters only: no bitmaps, page renders, subfolders and actions.log
+    int max_dict_memory_mb; // budget for decoded shared dictionaries with jobs, 0 - no limit
+    int inventory; // only list entries and chunks of document in inventory.txt/json, no JB2 decoding
+    const char* dict_cache; // folder of decoded shared dictionaries reused between runs or NULL
+    int incremental; // dump only entries changed since the previous run into the output folder (-resume too)
+    const char* pages; // -pages: ranges of page numbers (from 1) to dump or NULL for all
+    const char* entries; // -entries: ranges of DIRM positions to dump or NULL for all
 } Options;
 
 #endif // DJVUDICTOPTIONS_H
@@ -0,0 +1,526 @@
+/*
+ * djvudict-bench - generates a reproducible synthetic bundled DjVu document
+ * with minidjvu-mod encoder and times decoding paths of djvudict on it
+ * (or on the documents given in command line).
+ */
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+#include "../src/base/mdjvucfg.h" /* for i18n */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "bsdecoder.h"
+#include "djvudict_options.h"
+#include "djvudirreader.h"
+#include "djvudocument.h"
+#include "djvudump.h"
+#include "jb2dumper.h"
+#include "pathutils.h"
+#include "phasetimes.h"
+
+struct CorpusOptions
+{
+    int pages;
+    int symbols;    // per page
+    int window;     // pages sharing one Djbz, 0 - no shared dictionaries
+    int refine;     // % of symbols drawn as slightly changed copies of alphabet glyphs
+    int alphabet;   // glyphs per window
+    uint32 seed;
+};
+
+// Small LCG, so the corpus is the same on every platform
+class Random
+{
+public:
+    explicit Random(uint32 seed): m_state(seed * 2654435761u + 1) {}
+    uint32 next()
+    {
+        m_state = m_state * 1103515245u + 12345u;
+        return m_state >> 8;
+    }
+    int range(int lo, int hi) { return lo + (int) (next() % (uint32) (hi - lo + 1)); }
+private:
+    uint32 m_state;
+};
+
+static inline void set_pixel(mdjvu_bitmap_t b, int32 x, int32 y)
+{
+    mdjvu_bitmap_access_packed_row(b, y)[x >> 3] |= 0x80 >> (x & 7);
+}
+
+static mdjvu_bitmap_t create_blank(int32 w, int32 h)
+{
+    mdjvu_bitmap_t b = mdjvu_bitmap_create(w, h);
+    const int32 row_size = mdjvu_bitmap_get_packed_row_size(b);
+    for (int32 y = 0; y < h; y++) {
+        memset(mdjvu_bitmap_access_packed_row(b, y), 0, row_size);
+    }
+    return b;
+}
+
+// Frame with a few strokes inside, so glyph is a single connected component
+static mdjvu_bitmap_t make_glyph(Random& rnd)
+{
+    const int32 w = rnd.range(8, 24);
+    const int32 h = rnd.range(10, 28);
+    mdjvu_bitmap_t g = create_blank(w, h);
+    for (int32 x = 0; x < w; x++) {
+        set_pixel(g, x, 0);
+        set_pixel(g, x, h - 1);
+    }
+    for (int32 y = 0; y < h; y++) {
+        set_pixel(g, 0, y);
+        set_pixel(g, w - 1, y);
+    }
+    const int strokes = rnd.range(1, 4);
+    for (int i = 0; i < strokes; i++) {
+        if (rnd.next() & 1) {
+            const int32 y = rnd.range(1, h - 2);
+            for (int32 x = 0; x < w; x++) set_pixel(g, x, y);
+        } else {
+            const int32 x = rnd.range(1, w - 2);
+            for (int32 y = 0; y < h; y++) set_pixel(g, x, y);
+        }
+    }
+    return g;
+}
+
+// Copies glyph to the page. A changed copy gets a few pixels stuck to the frame,
+// so an encoder would rather refine it from the glyph than match it exactly.
+static void draw_glyph(mdjvu_bitmap_t page, mdjvu_bitmap_t g, int32 px, int32 py, bool changed, Random& rnd)
+{
+    const int32 w = mdjvu_bitmap_get_width(g);
+    const int32 h = mdjvu_bitmap_get_height(g);
+    for (int32 y = 0; y < h; y++) {
+        const unsigned char* row = mdjvu_bitmap_access_packed_row(g, y);
+        for (int32 x = 0; x < w; x++) {
+            if (row[x >> 3] & (0x80 >> (x & 7))) {
+                set_pixel(page, px + x, py + y);
+            }
+        }
+    }
+    if (changed) {
+        const int dots = rnd.range(1, 3);
+        for (int i = 0; i < dots; i++) {
+            set_pixel(page, px + rnd.range(1, w - 2), py + 1);
+        }
+    }
+}
+
+static mdjvu_bitmap_t make_page(const CorpusOptions& opts, const std::vector<mdjvu_bitmap_t>& alphabet, Random& rnd)
+{
+    const int32 page_w = 2550, page_h = 3300; // letter at 300 dpi
+    const int32 margin = 100, line_h = 40, spacing = 6;
+    mdjvu_bitmap_t page = create_blank(page_w, page_h);
+
+    int32 x = margin, y = margin;
+    for (int i = 0; i < opts.symbols; i++) {
+        mdjvu_bitmap_t g = alphabet[rnd.next() % alphabet.size()];
+        const int32 w = mdjvu_bitmap_get_width(g);
+        if (x + w > page_w - margin) {
+            x = margin;
+            y += line_h;
+        }
+        if (y + line_h > page_h - margin) {
+            break; // page is full
+        }
+        draw_glyph(page, g, x, y + line_h - 4 - mdjvu_bitmap_get_height(g), (int) (rnd.next() % 100) < opts.refine, rnd);
+        x += w + spacing;
+    }
+    return page;
+}
+
+// temporary file for a bundled element, closed by the caller
+static FILE* open_element(std::vector<FILE*>& tempfiles)
+{
+    FILE* f = tmpfile();
+    if (f) {
+        tempfiles.push_back(f);
+    }
+    return f;
+}
+
+static void add_element(FILE* f, const std::string& name, std::vector<std::string>& names, std::vector<int>& sizes)
+{
+    fflush(f);
+    sizes.push_back(ftell(f));
+    names.push_back(name);
+}
+
+// Bundled document: pages are split and compressed by minidjvu-mod
+// multipage encoder window by window, every window gets its own Djbz.
+static bool generate_corpus(const CorpusOptions& opts, const char* filename, int32* symbols)
+{
+    mdjvu_error_t err = NULL;
+    mdjvu_compression_options_t compression = mdjvu_compression_options_create();
+    mdjvu_set_aggression(compression, 100);
+    mdjvu_set_no_prototypes(compression, opts.refine == 0);
+
+    std::vector<std::string> names;
+    std::vector<FILE*> tempfiles;
+    std::vector<int> sizes;
+    bool ok = true;
+    *symbols = 0;
+
+    const int window = opts.window > 0 ? opts.window : 1;
+    for (int first = 0; ok && first < opts.pages; first += window) {
+        const int n = first + window <= opts.pages ? window : opts.pages - first;
+
+        Random rnd(opts.seed + first);
+        std::vector<mdjvu_bitmap_t> alphabet;
+        for (int i = 0; i < opts.alphabet; i++) {
+            alphabet.push_back(make_glyph(rnd));
+        }
+
+        std::vector<mdjvu_image_t> images;
+        for (int i = 0; i < n; i++) {
+            mdjvu_bitmap_t page = make_page(opts, alphabet, rnd);
+            images.push_back(mdjvu_split(page, 300, NULL));
+            mdjvu_bitmap_destroy(page);
+            *symbols += mdjvu_image_get_bitmap_count(images.back());
+        }
+        for (size_t i = 0; i < alphabet.size(); i++) {
+            mdjvu_bitmap_destroy(alphabet[i]);
+        }
+
+        std::string dict_name;
+        if (opts.window > 0) {
+            mdjvu_image_t dict = mdjvu_compress_multipage(n, images.data(), compression);
+            dict_name = "dict" + std::to_string(first / window) + ".iff";
+            FILE* f = open_element(tempfiles);
+            ok = f && mdjvu_file_save_djvu_dictionary(dict, (mdjvu_file_t) f, 0, &err, 0);
+            if (ok) {
+                add_element(f, dict_name, names, sizes);
+            }
+            mdjvu_image_destroy(dict);
+        } else {
+            mdjvu_compress_image(images[0], compression);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (ok) {
+                FILE* f = open_element(tempfiles);
+                ok = f && mdjvu_file_save_djvu_page(images[i], (mdjvu_file_t) f, dict_name.empty() ? NULL : dict_name.c_str(), 0, &err, 0);
+                if (ok) {
+                    add_element(f, "p" + std::to_string(first + i + 1) + ".djvu", names, sizes);
+                }
+            }
+            mdjvu_image_destroy(images[i]);
+        }
+    }
+    mdjvu_compression_options_destroy(compression);
+
+    if (ok) {
+        std::vector<char*> elements;
+        for (size_t i = 0; i < names.size(); i++) {
+            elements.push_back(const_cast<char*>(names[i].c_str()));
+        }
+        FILE* out = fopen(filename, "wb");
+        ok = out && mdjvu_file_save_djvu_dir(elements.data(), sizes.data(), elements.size(),
+                                             (mdjvu_file_t) out, (mdjvu_file_t*) tempfiles.data(), &err);
+        if (out) fclose(out);
+    }
+    for (size_t i = 0; i < tempfiles.size(); i++) {
+        fclose(tempfiles[i]);
+    }
+    if (!ok) {
+        fprintf(stderr, "Can't generate %s: %s\n", filename, err ? mdjvu_get_error_message(err) : "");
+    }
+    return ok;
+}
+
+/* ========================================================================= */
+
+struct BenchResult
+{
+    double best;    // seconds, best of repeats
+    double items;   // pages, entries or bytes per run
+    double symbols; // symbols per run
+};
+
+static void report(const char* name, const BenchResult& r, const char* items_name)
+{
+    printf("%-28s %10.3f ms %12.1f %s/s", name, r.best * 1000, r.best > 0 ? r.items / r.best : 0., items_name);
+    if (r.symbols > 0) {
+        printf(" %12.0f symbols/s", r.best > 0 ? r.symbols / r.best : 0.);
+    }
+    printf("\n");
+}
+
+static bool find_dirm(const DjVuDocument& doc, ChunkView* dirm)
+{
+    ChunkView form;
+    if (doc.size() < 4 || read_uint32_most_significant_byte_first_buf(doc.data()) != CHUNK_ID_AT_AND_T ||
+            !doc.readChunk(4, &form) || form.id != CHUNK_ID_FORM || form.length < 4 ||
+            read_uint32_most_significant_byte_first_buf(form.data) != ID_DJVM) {
+        return false;
+    }
+    return doc.firstChild(form, dirm) && dirm->id == ID_DIRM;
+}
+
+static bool bench_document(const char* filename, const char* work_path, int repeat, const Options& dump_opts)
+{
+    DjVuDocument doc;
+    mdjvu_error_t err = NULL;
+    if (!doc.open(filename, &err)) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return false;
+    }
+    ChunkView dirm;
+    if (!find_dirm(doc, &dirm)) {
+        fprintf(stderr, "%s isn't a bundled multi-page document\n", filename);
+        return false;
+    }
+    printf("%s (%u bytes):\n", filename, doc.size());
+
+    Options opts = dump_opts;
+    opts.verbose = 0;
+    opts.save_to_sql = 0;
+
+    DjVuDirReader dir;
+    if (!dir.decode(doc, dirm, &err, &opts)) {
+        fprintf(stderr, "Can't decode DIRM of %s\n", filename);
+        return false;
+    }
+    int32 pages = 0;
+    for (int32 i = 0; i < dir.count(); i++) {
+        if (dir.entries()[i].type == Page) pages++;
+    }
+
+    // BZZ stream of DIRM (the part after offsets)
+    const uint32 bzz_offset = dirm.offset + 3 + 4 * dir.count();
+    const int32 bzz_len = dirm.length - (3 + 4 * dir.count());
+    BenchResult bzz = { 1e30, 0, 0 };
+    for (int r = 0; r < repeat; r++) {
+        FILE* f = doc.openStream(bzz_offset, bzz_len);
+        if (!f) return false;
+        Stopwatch timer;
+        BSDecoder decoder(f, bzz_len);
+        std::vector<char> buf(decoder.decode());
+        decoder.read(buf.data(), buf.size());
+        decoder.close();
+        const double t = timer.elapsed();
+        fclose(f);
+        bzz.best = t < bzz.best ? t : bzz.best;
+        bzz.items = buf.size();
+    }
+    report("BSDecoder::decode", bzz, "bytes");
+
+    BenchResult dirm_res = { 1e30, (double) dir.count(), 0 };
+    for (int r = 0; r < repeat; r++) {
+        DjVuDirReader reader;
+        Stopwatch timer;
+        reader.decode(doc, dirm, &err, &opts);
+        const double t = timer.elapsed();
+        dirm_res.best = t < dirm_res.best ? t : dirm_res.best;
+    }
+    report("DjVuDirReader::decode", dirm_res, "entries");
+
+    // JB2 decoding only: stats-only dump, time of JB2 phase
+    BenchResult jb2 = { 1e30, (double) pages, 0 };
+    const std::string stats_path = get_statsname(work_path, "bench_stats");
+    for (int r = 0; r < repeat; r++) {
+        Options stats_opts = opts;
+        stats_opts.stats_only = 1;
+        JB2Dumper dumper;
+        dumper.dumpMultiPage(doc, dir.entries(), dir.count(), stats_path.c_str(), &err, &stats_opts);
+        const double t = dumper.times().get(PhaseTimes::JB2Decode);
+        jb2.best = t < jb2.best ? t : jb2.best;
+        jb2.symbols = dumper.counters().total(Counters::ElementsOnPage);
+    }
+    report("loadAndDumpJB2Image", jb2, "pages");
+
+    BenchResult full = { 1e30, (double) pages, jb2.symbols };
+    const std::string dump_path = get_statsname(work_path, "bench_dump");
+    for (int r = 0; r < repeat; r++) {
+        Stopwatch timer;
+        if (!dump_djvu_dict(filename, dump_path.c_str(), &err, &opts)) {
+            fprintf(stderr, "Can't dump %s\n", filename);
+            return false;
+        }
+        const double t = timer.elapsed();
+        full.best = t < full.best ? t : full.best;
+    }
+    report("dump_djvu_dict", full, "pages");
+    return true;
+}
+
+/* ========================================================================= */
+
+// Inverse block sort of BSDecoder::decode as it was before bs_unsort(),
+// the reference for -bzz
+static bool reference_unsort(unsigned char *data, int size, int markerpos)
+{
+    unsigned int *posn = (unsigned int*) ::operator new(sizeof(unsigned int) * size);
+    memset(posn, 0, sizeof(unsigned int) * size);
+    int count[256];
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i < size; i++) {
+        if (i == markerpos) continue;
+        const unsigned char c = data[i];
+        posn[i] = (c << 24) | (count[c] & 0xffffff);
+        count[c] += 1;
+    }
+    int last = 1;
+    for (int i = 0; i < 256; i++) {
+        const int tmp = count[i];
+        count[i] = last;
+        last += tmp;
+    }
+    int i = 0;
+    last = size - 1;
+    while (last > 0) {
+        const unsigned int n = posn[i];
+        const unsigned char c = n >> 24;
+        data[--last] = c;
+        i = count[c] + (n & 0xffffff);
+    }
+    ::operator delete(posn);
+    return i == markerpos;
+}
+
+// Text-like block: words of a small vocabulary, so the transform has runs
+// and MTF ranks are mostly small, like in DIRM names and real BZZ streams
+static std::vector<unsigned char> make_bzz_block(int size, uint32 seed)
+{
+    Random rnd(seed);
+    std::vector<std::string> words;
+    for (int i = 0; i < 500; i++) {
+        std::string w;
+        const int len = rnd.range(2, 10);
+        for (int k = 0; k < len; k++) {
+            w += (char) ('a' + rnd.range(0, 25));
+        }
+        words.push_back(w);
+    }
+    std::vector<unsigned char> data;
+    data.reserve(size);
+    while ((int) data.size() < size - 1) {
+        const std::string& w = words[rnd.next() % words.size()];
+        data.insert(data.end(), w.begin(), w.end());
+        data.push_back(rnd.next() % 8 ? ' ' : '\n');
+    }
+    data.resize(size - 1);
+    data.push_back(0); // end marker of block sort
+    return data;
+}
+
+// Inverse block sort of BSDecoder on blocks of block_mb Mb (a BZZ block is up to 4 Mb)
+static bool bench_bzz(int block_mb, int repeat, uint32 seed)
+{
+    int size = block_mb << 20;
+    if (size > 4096 * 1024) size = 4096 * 1024;
+    const std::vector<unsigned char> original = make_bzz_block(size, seed);
+    std::vector<unsigned char> sorted = original;
+    int markerpos;
+    bs_blocksort(sorted.data(), size, markerpos);
+    printf("BZZ block of %d bytes:\n", size);
+
+    BenchResult ref = { 1e30, (double) size, 0 }, fast = ref;
+    std::vector<unsigned char> ref_data, fast_data;
+    BSUnsortBuffers buffers; // reused by all runs, like by blocks of a stream
+    for (int r = 0; r < repeat; r++) {
+        ref_data = sorted;
+        Stopwatch ref_timer;
+        const bool ref_ok = reference_unsort(ref_data.data(), size, markerpos);
+        const double ref_t = ref_timer.elapsed();
+        fast_data = sorted;
+        Stopwatch fast_timer;
+        const bool fast_ok = bs_unsort(fast_data.data(), size, markerpos, buffers);
+        const double fast_t = fast_timer.elapsed();
+        if (!ref_ok || !fast_ok || ref_data != fast_data ||
+                memcmp(fast_data.data(), original.data(), size - 1)) {
+            fprintf(stderr, "bs_unsort output differs from the reference\n");
+            return false;
+        }
+        ref.best = ref_t < ref.best ? ref_t : ref.best;
+        fast.best = fast_t < fast.best ? fast_t : fast.best;
+    }
+    report("inverse BWT (original)", ref, "bytes");
+    report("bs_unsort", fast, "bytes");
+    return true;
+}
+
+static void show_usage_and_exit(void)
+{
+    printf(_("Usage:\n"));
+    printf(_("    djvudict-bench [options] <work folder> [document.djvu ...]\n"));
+    printf(_("    djvudict-bench -bzz <Mb> [-repeat <n>] [-seed <n>]\n"));
+    printf(_("Without documents a synthetic document is generated in the work folder.\n"));
+    printf(_("-bzz times inverse block sort of BZZ on a text-like block.\n"));
+    printf(_("Options:\n"));
+    printf(_("    -pages <n>:      pages in synthetic document (default 40)\n"));
+    printf(_("    -symbols <n>:    symbols per page (default 1500)\n"));
+    printf(_("    -window <n>:     pages sharing a Djbz, 0 - no shared dictionaries (default 10)\n"));
+    printf(_("    -refine <n>:     percent of changed symbols to be refined (default 20)\n"));
+    printf(_("    -alphabet <n>:   distinct glyphs per window (default 120)\n"));
+    printf(_("    -seed <n>:       seed of synthetic document (default 1)\n"));
+    printf(_("    -repeat <n>:     runs of every measurement, the best is reported (default 3)\n"));
+    printf(_("    -jobs <n>:       threads for dump_djvu_dict (default 1)\n"));
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    CorpusOptions corpus = { 40, 1500, 10, 20, 120, 1 };
+    Options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.jobs = 1;
+    opts.output_format = OutputDir;
+    int repeat = 3;
+    int bzz_mb = 0;
+
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        const char* option = argv[i] + 1;
+        if (i + 1 >= argc) show_usage_and_exit();
+        const int val = atoi(argv[++i]);
+        if (val < 0) show_usage_and_exit();
+        if (!strcmp(option, "pages")) corpus.pages = val;
+        else if (!strcmp(option, "symbols")) corpus.symbols = val;
+        else if (!strcmp(option, "window")) corpus.window = val;
+        else if (!strcmp(option, "refine")) corpus.refine = val;
+        else if (!strcmp(option, "alphabet")) corpus.alphabet = val ? val : 1;
+        else if (!strcmp(option, "seed")) corpus.seed = val;
+        else if (!strcmp(option, "repeat")) repeat = val ? val : 1;
+        else if (!strcmp(option, "jobs")) opts.jobs = val;
+        else if (!strcmp(option, "bzz")) bzz_mb = val;
+        else show_usage_and_exit();
+    }
+    if (bzz_mb > 0) {
+        return bench_bzz(bzz_mb, repeat, corpus.seed) ? 0 : 1;
+    }
+    if (i >= argc) {
+        show_usage_and_exit();
+    }
+    const char* work_path = argv[i++];
+    if (mkpath(work_path)) {
+        fprintf(stderr, "Can't create %s\n", work_path);
+        return 1;
+    }
+
+    std::vector<std::string> documents(argv + i, argv + argc);
+    if (documents.empty()) {
+        const std::string filename = get_statsname(work_path, "synthetic.djvu");
+        printf("Generating %d pages, %d symbols per page, Djbz window %d, %d%% refined, seed %u\n",
+               corpus.pages, corpus.symbols, corpus.window, corpus.refine, corpus.seed);
+        Stopwatch timer;
+        int32 symbols;
+        if (!generate_corpus(corpus, filename.c_str(), &symbols)) {
+            return 1;
+        }
+        printf("%d symbols encoded in %.3f s\n", symbols, timer.elapsed());
+        documents.push_back(filename);
+    }
+
+    int res = 0;
+    for (size_t d = 0; d < documents.size(); d++) {
+        if (!bench_document(documents[d].c_str(), work_path, repeat, opts)) {
+            res = 1;
+        }
+    }
+    return res;
+}
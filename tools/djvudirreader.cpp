@@ -4,21 +4,6 @@
 #include <assert.h>
 #include "bsdecoder.h"
 
-static uint32 read_uint32_most_significant_byte_first(FILE *f)
-{
-    return fgetc(f) << 24 | fgetc(f) << 16 | fgetc(f) << 8 | fgetc(f);
-}
-
-static uint16 read_uint16_most_significant_byte_first(FILE *f)
-{
-    return fgetc(f) << 8 | fgetc(f);
-}
-
-static uint32 read_uint24_most_significant_byte_first_buf(const char* b)
-{
-    return b[0] << 16 | b[1] << 8 | b[2];
-}
-
 inline void skip_till_next_str(const char* buf, int& pos)
 {
     while (buf[pos]) pos++;
@@ -27,13 +12,18 @@ inline void skip_till_next_str(const char* buf, int& pos)
 
 DjVuDirReader::DjVuDirReader(): m_entries_cnt(0), m_entries(NULL), m_buf(NULL) {}
 
-int DjVuDirReader::decode(FILE * f, int32 size, mdjvu_error_t *perr, Options *opts)
+int DjVuDirReader::decode(const DjVuDocument& doc, const ChunkView& dirm, mdjvu_error_t *perr, const Options *opts)
 {
-    assert(size >= 3);
-
     close(); // free and null buffers
 
-    unsigned char flags = (unsigned char) fgetc(f);
+    const int32 size = dirm.length;
+    const unsigned char* p = dirm.data;
+    if (size < 3) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+
+    unsigned char flags = p[0];
     if (!(flags & 0x80 /*0b10000000*/)) {
         fprintf(stderr, "DjVu is inderectly coded. We support only bundled multi-page DjVu documents.\n");
         if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
@@ -43,38 +33,45 @@ int DjVuDirReader::decode(FILE * f, int32 size, mdjvu_error_t *perr, Options *op
         fprintf(stdout, "Bundled DjVu found. DIRM reports format version %u\n", flags & 0x7F /*0b01111111*/);
     }
 
-    m_entries_cnt = read_uint16_most_significant_byte_first(f);
+    m_entries_cnt = read_uint16_most_significant_byte_first_buf(p + 1);
 
     if (opts->verbose) {
         fprintf(stdout, "Files bundled %u\n", m_entries_cnt);
     }
 
+    int32 size_left = size - (1 + 2 + 4*m_entries_cnt);
+    if (size_left < 0) {
+        m_entries_cnt = 0;
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+
     m_entries = (DIRM_Entry*) malloc (m_entries_cnt* sizeof(DIRM_Entry));
     for (uint16 i = 0; i < m_entries_cnt; i++) { //read file offsets
-        m_entries[i].offset = read_uint32_most_significant_byte_first(f);
+        m_entries[i].offset = read_uint32_most_significant_byte_first_buf(p + 3 + 4*i);
     }
 
-
-//    skip_in_chunk(&DIRM, 1+2+4*m_entries_cnt);
-
     if (!m_entries_cnt) {
         return size;
     }
 
-    int32 size_left = size - (1 + 2 + 4*m_entries_cnt);
-    assert(size_left >= 0);
+    FILE* f = doc.openStream(dirm.offset + 3 + 4*m_entries_cnt, size_left);
+    if (!f) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
 
     BSDecoder decoder(f, size_left);
     int32 data_len = decoder.decode();
     m_buf = (char*) malloc (data_len);
     int readed = decoder.read(m_buf, data_len);
     decoder.close();
-//    skip_in_chunk(&DIRM, size_left);
+    fclose(f);
     assert(readed == data_len);
 
     int32 buf_pos = 0;
     for (int32 i = 0; i < m_entries_cnt; i++) { //read file sizes
-        m_entries[i].size = read_uint24_most_significant_byte_first_buf(m_buf+buf_pos);
+        m_entries[i].size = read_uint24_most_significant_byte_first_buf((const unsigned char*) m_buf+buf_pos);
         buf_pos += 3;
     }
     for (int32 i = 0; i < m_entries_cnt; i++, buf_pos++) { //read file str_flags
@@ -97,7 +94,7 @@ int DjVuDirReader::decode(FILE * f, int32 size, mdjvu_error_t *perr, Options *op
             m_entries[i].title_str = m_buf + buf_pos;
             skip_till_next_str(m_buf, buf_pos);
         } else {
-            m_entries[i].name_str = NULL;
+            m_entries[i].title_str = NULL;
         }
 
         m_entries[i].type = (DIRM_EntryType) (flag & 0x3F /*0b00111111*/);
@@ -2,6 +2,7 @@
 #define DJVUDIRREADER_H
 #include "../include/minidjvu-mod/minidjvu-mod.h"
 #include "djvudict_options.h"
+#include "djvudocument.h"
 #include <stdio.h>
 
 enum DIRM_EntryType {
@@ -27,13 +28,12 @@ public:
     DjVuDirReader();
     ~DjVuDirReader();
 
-    int decode(FILE * f, int32 size, mdjvu_error_t *perr, struct Options* opts);
+    int decode(const DjVuDocument& doc, const ChunkView& dirm, mdjvu_error_t *perr, const struct Options* opts);
     void close();
 
     inline DIRM_Entry* entries() const { return m_entries; }
     inline int32 count() const { return m_entries_cnt; }
 private:
-    FILE * m_f;
     int32 m_entries_cnt;
     DIRM_Entry* m_entries;
     char* m_buf;
@@ -0,0 +1,215 @@
+#include "djvudocument.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(windows) || defined(WIN32))
+#define NO_MMAP
+#define NO_FMEMOPEN
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+DjVuDocument::DjVuDocument(): m_f(NULL), m_data(NULL), m_size(0), m_mapped(false), m_stdin(false) {}
+
+DjVuDocument::~DjVuDocument()
+{
+    close();
+}
+
+bool DjVuDocument::open(const char* filename, mdjvu_error_t *perr)
+{
+    close();
+
+    if (!strcmp(filename, "-")) {
+        return readStdin(perr);
+    }
+
+    m_filename = filename;
+    m_f = fopen(filename, "rb");
+    if (!m_f) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return false;
+    }
+
+#ifndef NO_MMAP
+    struct stat st;
+    if (fstat(fileno(m_f), &st) == 0 && st.st_size > 0 && (unsigned long long) st.st_size <= 0xFFFFFFFFull) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(m_f), 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_WILLNEED);
+            m_data = (unsigned char*) p;
+            m_size = (uint32) st.st_size;
+            m_mapped = true;
+            return true;
+        }
+    }
+#endif
+
+    // fallback: read the whole file in memory
+    if (fseek(m_f, 0, SEEK_END) == 0) {
+        long len = ftell(m_f);
+        if (len > 0 && (unsigned long long) len > 0xFFFFFFFFull) { // IFF sizes are 32-bit
+            fprintf(stderr, "%s is larger than 4 GiB, which DjVu can't address\n", filename);
+            close();
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return false;
+        }
+        if (len > 0) {
+            m_data = (unsigned char*) malloc(len);
+            fseek(m_f, 0, SEEK_SET);
+            if (m_data && fread(m_data, 1, len, m_f) == (size_t) len) {
+                m_size = (uint32) len;
+                return true;
+            }
+        }
+    }
+
+    close();
+    if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+    return false;
+}
+
+// stdin can't be mapped or reopened, so it's read in memory
+bool DjVuDocument::readStdin(mdjvu_error_t *perr)
+{
+#if (defined(windows) || defined(WIN32))
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    m_stdin = true;
+    size_t capacity = 0, len = 0;
+    for (;;) {
+        if (len == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            unsigned char* p = capacity < 0xFFFFFFFFull ? (unsigned char*) realloc(m_data, capacity) : NULL;
+            if (!p) {
+                break;
+            }
+            m_data = p;
+        }
+        const size_t readed = fread(m_data + len, 1, capacity - len, stdin);
+        len += readed;
+        if (!readed) {
+            if (ferror(stdin) || !len) {
+                break;
+            }
+            m_size = (uint32) len;
+            return true;
+        }
+    }
+
+    close();
+    if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+    return false;
+}
+
+void DjVuDocument::close()
+{
+    if (m_data) {
+#ifndef NO_MMAP
+        if (m_mapped) {
+            munmap(m_data, m_size);
+        } else
+#endif
+        {
+            free(m_data);
+        }
+        m_data = NULL;
+    }
+    m_size = 0;
+    m_mapped = false;
+    m_stdin = false;
+
+    if (m_f) {
+        fclose(m_f);
+        m_f = NULL;
+    }
+}
+
+bool DjVuDocument::readChunk(uint32 offset, ChunkView* chunk) const
+{
+    if (!m_data || offset > m_size || m_size - offset < 8) {
+        return false;
+    }
+    const unsigned char* p = m_data + offset;
+    const uint32 length = read_uint32_most_significant_byte_first_buf(p + 4);
+    if (length > m_size - offset - 8) {
+        return false;
+    }
+    chunk->id = read_uint32_most_significant_byte_first_buf(p);
+    chunk->length = length;
+    chunk->offset = offset + 8;
+    chunk->data = p + 8;
+    return true;
+}
+
+bool DjVuDocument::firstChild(const ChunkView& form, ChunkView* child) const
+{
+    if (form.length < 4 + 8) {
+        return false;
+    }
+    if (!readChunk(form.offset + 4, child)) {
+        return false;
+    }
+    return child->offset + child->length <= form.offset + form.length;
+}
+
+bool DjVuDocument::nextSibling(const ChunkView& parent, ChunkView* chunk) const
+{
+    // chunks are aligned on even offsets (DjVu3Spec.pdf p.9)
+    const uint32 next = (chunk->offset + chunk->length + 1) & ~1u;
+    const uint32 parent_end = parent.offset + parent.length;
+    if (next + 8 > parent_end) {
+        return false;
+    }
+    ChunkView sibling;
+    if (!readChunk(next, &sibling) || sibling.offset + sibling.length > parent_end) {
+        return false;
+    }
+    *chunk = sibling;
+    return true;
+}
+
+bool DjVuDocument::findChild(const ChunkView& form, uint32 id, ChunkView* chunk) const
+{
+    if (!firstChild(form, chunk)) {
+        return false;
+    }
+    while (chunk->id != id) {
+        if (!nextSibling(form, chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FILE* DjVuDocument::openStream(uint32 offset, uint32 length) const
+{
+    if (!m_data || offset > m_size || length > m_size - offset) {
+        return NULL;
+    }
+#ifndef NO_FMEMOPEN
+    // empty stream may be refused, ZP decoder reads nothing from it anyway
+    return fmemopen(length ? m_data + offset : m_data, length ? length : 1, "rb");
+#else
+    FILE* f;
+    if (m_stdin) { // nothing to reopen, copy the span
+        f = tmpfile();
+        if (f && (fwrite(m_data + offset, 1, length, f) != length || fseek(f, 0, SEEK_SET))) {
+            fclose(f);
+            f = NULL;
+        }
+        return f;
+    }
+    f = fopen(m_filename.c_str(), "rb");
+    if (f && fseek(f, offset, SEEK_SET)) {
+        fclose(f);
+        f = NULL;
+    }
+    return f;
+#endif
+}
@@ -0,0 +1,82 @@
+#ifndef DJVUDOCUMENT_H
+#define DJVUDOCUMENT_H
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+#include <stdio.h>
+#include <string>
+
+#define CHUNK_ID_AT_AND_T 0x41542654
+#define CHUNK_ID_FORM     0x464F524D
+#define ID_DJVU           0x444A5655
+#define ID_DJVM           0x444A564D
+#define ID_DJVI           0x444A5649
+#define ID_DIRM           0x4449524D
+
+static inline uint32 read_uint32_most_significant_byte_first_buf(const unsigned char* b)
+{
+    return (uint32) b[0] << 24 | (uint32) b[1] << 16 | (uint32) b[2] << 8 | (uint32) b[3];
+}
+
+static inline uint32 read_uint24_most_significant_byte_first_buf(const unsigned char* b)
+{
+    return (uint32) b[0] << 16 | (uint32) b[1] << 8 | (uint32) b[2];
+}
+
+static inline uint16 read_uint16_most_significant_byte_first_buf(const unsigned char* b)
+{
+    return (uint16) (b[0] << 8 | b[1]);
+}
+
+// A bounds-checked view of an IFF chunk inside of a mapped document.
+// For FORM chunks the payload starts with 4-byte form type (DJVU, DJVM, DJVI...)
+struct ChunkView
+{
+    uint32 id;
+    uint32 length;              // payload length as stored in chunk header
+    uint32 offset;              // payload offset from the beginning of the file
+    const unsigned char* data;  // payload, not own
+};
+
+// Read-only document mapped in memory. Replaces per-byte fgetc()/fseek()
+// walking over IFF structure. Decoders that still need stdio get a FILE*
+// reading the chunk they decode straight from memory.
+class DjVuDocument
+{
+public:
+    DjVuDocument();
+    ~DjVuDocument();
+
+    // "-" reads the document from stdin
+    bool open(const char* filename, mdjvu_error_t *perr);
+    void close();
+
+    inline const unsigned char* data() const { return m_data; }
+    inline uint32 size() const { return m_size; }
+
+    // reads chunk header at offset and checks that payload fits into the document
+    bool readChunk(uint32 offset, ChunkView* chunk) const;
+    // first child chunk of FORM (form type is skipped)
+    bool firstChild(const ChunkView& form, ChunkView* child) const;
+    // moves chunk to next sibling inside of parent, returns false at the end of parent
+    bool nextSibling(const ChunkView& parent, ChunkView* chunk) const;
+    // searches chunk with id among children of FORM
+    bool findChild(const ChunkView& form, uint32 id, ChunkView* chunk) const;
+
+    // new stdio handle over length bytes at offset (for ZP-based decoders,
+    // which read only through FILE*). It reads the document memory (fmemopen),
+    // so no file is reopened and every caller has its own cursor, decoders may
+    // run in parallel. Should be closed with fclose()
+    FILE* openStream(uint32 offset, uint32 length) const;
+
+private:
+    bool readStdin(mdjvu_error_t *perr);
+
+    std::string m_filename;
+    FILE* m_f;
+    unsigned char* m_data;
+    uint32 m_size;
+    bool m_mapped;
+    bool m_stdin;
+};
+
+#endif // DJVUDOCUMENT_H
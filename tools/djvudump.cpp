@@ -0,0 +1,246 @@
+#include "djvudump.h"
+#include "djvudocument.h"
+#include "djvudirreader.h"
+#include "inventory.h"
+#include "jb2dumper.h"
+#include "jb2visitor.h"
+#include "pathutils.h"
+#include "workerpool.h"
+#include <string.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#ifndef _WIN32
+#include <glob.h>
+#endif
+
+const char *link_to_filename(const char *path_to_djvu) {
+    if (!strcmp(path_to_djvu, "-")) {
+        return "stdin.djvu";
+    }
+    int32 pos = strlen(path_to_djvu);
+    while (pos > 0 && path_to_djvu[pos] != '/' && path_to_djvu[pos] != '\\') pos--;
+    return path_to_djvu + pos +1;
+}
+
+uint32 dump_djvu_dict(const char *djvu_filepath, const char *out_path, mdjvu_error_t *perr, const Options* opts,
+                      WorkerPool* shared_pool, Counters* totals, JB2Visitor* visitor)
+{
+    if (perr) {
+        *perr = NULL;
+    }
+
+    DjVuDocument doc;
+    if (!doc.open(djvu_filepath, perr)) {
+        return 0;
+    }
+
+    if (doc.size() < 4 || read_uint32_most_significant_byte_first_buf(doc.data()) != CHUNK_ID_AT_AND_T)
+    {
+        fprintf(stderr, "No AT&T tag found.\n");
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+
+    ChunkView FORM;
+    if (!doc.readChunk(4, &FORM) || FORM.id != CHUNK_ID_FORM || FORM.length < 4)
+    {
+        fprintf(stderr, "No FORM tag found.\n");
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+
+    uint32 id = read_uint32_most_significant_byte_first_buf(FORM.data);
+    if (id == ID_DJVU)
+    { // single-page DjVu
+        DIRM_Entry single_page;
+        single_page.size = FORM.length;
+        single_page.type = Page;
+        // should be FORM start
+        single_page.offset = FORM.offset - 8 /*FORM header*/;
+        const char flags = 0x81; // 0b10000001;
+        single_page.str_flags = &flags;
+        single_page.id_str = link_to_filename(djvu_filepath);
+        single_page.name_str = NULL;
+        single_page.title_str = NULL;
+
+        if (opts->inventory) {
+            Inventory inventory;
+            return inventory.read(doc, &single_page, 1, false, perr) && inventory.save(out_path, djvu_filepath, perr);
+        }
+
+        JB2Dumper dumper;
+        dumper.setVisitor(visitor);
+        dumper.dumpMultiPage(doc, &single_page, 1, out_path, perr, opts, shared_pool);
+        if (totals) *totals = dumper.counters();
+    } else if (id == ID_DJVM)
+    { // multi-page DjVu
+        ChunkView DIRM;
+        if (!doc.firstChild(FORM, &DIRM) || DIRM.id != ID_DIRM) {
+            fprintf(stderr, "No DIRM tag found.\n");
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return 0;
+        }
+
+        JB2Dumper dumper;
+        dumper.setVisitor(visitor);
+        DjVuDirReader dir;
+        int readed_len;
+        {
+            PhaseTimer timer(&dumper.times(), PhaseTimes::DirmDecode);
+            readed_len = dir.decode(doc, DIRM, perr, opts);
+        }
+        if (*perr || !readed_len) {
+            fprintf(stderr, "No DIRM tag found.\n");
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return 0;
+        }
+        if (opts->inventory) {
+            Inventory inventory;
+            return inventory.read(doc, dir.entries(), dir.count(), true, perr) && inventory.save(out_path, djvu_filepath, perr);
+        }
+        dumper.dumpMultiPage(doc, dir.entries(), dir.count(), out_path, perr, opts, shared_pool);
+        if (totals) *totals = dumper.counters();
+
+    } else {
+        fprintf(stderr, "No DJVU or DJVM tag found.\n");
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_wrong_djvu_type);
+        return 0;
+    }
+
+    return 1;
+}
+
+uint32 djvu_visit_document(const char* djvu_filepath, JB2Visitor* visitor, const Options* opts,
+                           mdjvu_error_t* perr, const char* out_path)
+{
+    Options visit_opts = *opts;
+    visit_opts.inventory = 0;
+    if (!out_path) { // outputs that need files are off
+        visit_opts.stats_only = 1;
+        visit_opts.save_to_sql = visit_opts.sql_direct = 0;
+        visit_opts.write_columns = 0;
+        visit_opts.write_manifest = 0;
+        visit_opts.io_threads = 0;
+        visit_opts.output_format = OutputDir;
+    }
+    return dump_djvu_dict(djvu_filepath, out_path, perr, &visit_opts, NULL, NULL, visitor);
+}
+
+// file name without folder and .djvu/.djv extension
+static std::string document_name(const std::string& path)
+{
+    std::string name = link_to_filename(path.c_str());
+    const size_t dot = name.rfind('.');
+    if (dot != std::string::npos && dot > 0) {
+        name.erase(dot);
+    }
+    return name;
+}
+
+static bool add_batch_input(const char* input, std::vector<std::string>& files)
+{
+    if (input[0] == '@') {
+        FILE* f = fopen(input + 1, "r");
+        if (!f) {
+            fprintf(stderr, "Can't open list file %s\n", input + 1);
+            return false;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            size_t len = strlen(line);
+            while (len && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = 0;
+            if (len && line[0] != '#') {
+                files.push_back(line);
+            }
+        }
+        fclose(f);
+        return true;
+    }
+#ifndef _WIN32
+    // patterns may be quoted to get past the shell argument limit
+    if (strpbrk(input, "*?[")) {
+        glob_t found;
+        const int res = glob(input, 0, NULL, &found);
+        if (res == 0) {
+            for (size_t i = 0; i < found.gl_pathc; i++) {
+                files.push_back(found.gl_pathv[i]);
+            }
+        } else if (res == GLOB_NOMATCH) {
+            fprintf(stderr, "Warning: no documents match %s\n", input);
+        }
+        globfree(&found);
+        return res == 0 || res == GLOB_NOMATCH;
+    }
+#endif
+    files.push_back(input);
+    return true;
+}
+
+uint32 dump_djvu_batch(char* const* inputs, int count, const char *out_path, const Options* opts)
+{
+    std::vector<std::string> files;
+    for (int i = 0; i < count; i++) {
+        if (!add_batch_input(inputs[i], files)) {
+            return 0;
+        }
+    }
+    if (files.empty()) {
+        fprintf(stderr, "No documents to dump.\n");
+        return 0;
+    }
+    if (mkpath(out_path)) {
+        fprintf(stderr, "Can't create %s\n", out_path);
+        return 0;
+    }
+
+    // Pages of all open documents go to one pool, so workers that are done
+    // with small documents take pages of large ones. A document is opened,
+    // waited for and committed in DIRM order by its driver thread; there are
+    // twice as many drivers as workers to keep the page queue filled while
+    // drivers parse DIRM and commit entries.
+    const int jobs = opts->jobs > 0 ? opts->jobs : WorkerPool::hardwareThreads();
+    WorkerPool pages(jobs);
+    WorkerPool documents(std::min<int>(2 * jobs, files.size()));
+
+    Counters corpus;
+    std::mutex corpus_mutex;
+    int failed = 0;
+    Stopwatch wall;
+    for (size_t i = 0; i < files.size(); i++) {
+        documents.submit([&, i] {
+            // index in the folder name keeps documents with the same name apart
+            const std::string doc_path = get_subdir(out_path, document_name(files[i]), i);
+            mdjvu_error_t err = NULL;
+            Counters totals;
+            const uint32 res = dump_djvu_dict(files[i].c_str(), doc_path.c_str(), &err, opts, &pages, &totals);
+
+            std::lock_guard<std::mutex> lock(corpus_mutex);
+            if (!res || err) {
+                failed++;
+                fprintf(stderr, "ERROR: %s: %s\n", files[i].c_str(), err ? mdjvu_get_error_message(err) : "not dumped");
+            }
+            if (res) {
+                corpus.mergeTotals(totals);
+            }
+            if (opts->verbose) {
+                fprintf(stdout, "%s -> %s\n", files[i].c_str(), doc_path.c_str());
+            }
+        });
+    }
+    documents.wait();
+    pages.wait();
+
+    if (!opts->inventory) {
+        LogFile corpusLog(&corpus, true);
+        corpusLog.open(get_statsname(out_path, "stats.log").data());
+        corpusLog.close();
+    }
+
+    if (opts->verbose || failed) {
+        fprintf(failed ? stderr : stdout, "%d of %d documents dumped in %.3f s\n",
+                (int)files.size() - failed, (int)files.size(), wall.elapsed());
+    }
+    return failed == 0;
+}
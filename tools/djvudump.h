@@ -0,0 +1,23 @@
+#ifndef DJVUDUMP_H
+#define DJVUDUMP_H
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+#include "djvudict_options.h"
+
+class WorkerPool;
+class Counters;
+class JB2Visitor;
+
+const char *link_to_filename(const char *path_to_djvu);
+
+// dumps single-page or bundled multi-page document to out_path
+// pages go to shared_pool if it's set, document totals are copied to totals,
+// events of JB2 images go to visitor
+uint32 dump_djvu_dict(const char *djvu_filepath, const char *out_path, mdjvu_error_t *perr, const Options* opts,
+                      WorkerPool* shared_pool = NULL, Counters* totals = NULL, JB2Visitor* visitor = NULL);
+
+// dumps each of documents to its own folder in out_path, inputs are file
+// names, glob patterns or @<list file> with a file name per line
+uint32 dump_djvu_batch(char* const* inputs, int count, const char *out_path, const Options* opts);
+
+#endif // DJVUDUMP_H
@@ -0,0 +1,38 @@
+#include "formrecord.h"
+#include <string.h>
+
+// FNV-1a of size (little-endian 32-bit width and height) and packed rows
+static unsigned long long hash_bitmap(int w, int h, const std::vector<unsigned char>& data)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    const unsigned int size[2] = { (unsigned int) w, (unsigned int) h };
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((size[i / 4] >> (i % 4 * 8)) & 0xFF)) * 1099511628211ull;
+    }
+    for (size_t i = 0; i < data.size(); i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash ? hash : 1; // 0 is "no bitmap"
+}
+
+unsigned long long
+FormRecord::add_bitmap(mdjvu_bitmap_t bitmap, bool new_bitmap)
+{
+    const int32 bw = mdjvu_bitmap_get_width(bitmap);
+    const int32 bh = mdjvu_bitmap_get_height(bitmap);
+    const int32 row_size = (bw + 7) / 8;
+    const unsigned char last_mask = bw % 8 ? (unsigned char) (0xFF << (8 - bw % 8)) : 0xFF;
+
+    packed.resize((size_t) row_size * bh);
+    for (int32 y = 0; y < bh; y++) {
+        unsigned char* row = packed.data() + (size_t) row_size * y;
+        memcpy(row, mdjvu_bitmap_access_packed_row(bitmap, y), row_size);
+        if (row_size) row[row_size - 1] &= last_mask;
+    }
+    const unsigned long long hash = hash_bitmap(bw, bh, packed);
+    if (new_bitmap && bitmap_hashes.insert(hash).second) {
+        Bitmap b = { hash, bw, bh, packed };
+        bitmaps.push_back(b);
+    }
+    return hash;
+}
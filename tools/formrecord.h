@@ -0,0 +1,93 @@
+#ifndef FORMRECORD_H
+#define FORMRECORD_H
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+#include "jb2visitor.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+// Rows of a single DIRM entry collected while it's dumped (for SQLite
+// and columnar outputs). Entries may be dumped in parallel, so rows are
+// written only when the entry is committed in DIRM order.
+struct FormRecord
+{
+    struct Letter
+    {
+        int local_id, x, y, w, h;
+        int to_image, to_library, is_non_symbol;
+        int ref_local_id, from_djbz, is_refinement;
+        std::string filename;
+        double bits, index_bits; // compressed size of the record, of its matching index
+        unsigned long long bitmap_hash; // 0 - bitmaps aren't stored
+    };
+
+    // packed 1-bit rows, (w+7)/8 bytes per row, padding bits are 0
+    struct Bitmap
+    {
+        unsigned long long hash;
+        int w, h;
+        std::vector<unsigned char> data;
+    };
+
+    FormRecord(): type(0), w(0), h(0), version(0), dpi(0), djbz_name(nullptr), store_bitmaps(false) {}
+
+    // bitmap is the shape of the letter. With store_bitmaps it's hashed
+    // and, if it's decoded by this record (new_bitmap), kept for the bitmaps table
+    void add_letter(int local_id, int x, int y, int w, int h,
+                    int to_image, int to_library, int is_non_symbol,
+                    int ref_local_id, int from_djbz,
+                    int is_refinement, const char* filename,
+                    double bits, double index_bits,
+                    mdjvu_bitmap_t bitmap, bool new_bitmap)
+    {
+        Letter l = { local_id, x, y, w, h, to_image, to_library, is_non_symbol,
+                     ref_local_id, from_djbz, is_refinement, filename, bits, index_bits,
+                     store_bitmaps && bitmap ? add_bitmap(bitmap, new_bitmap) : 0 };
+        letters.push_back(l);
+    }
+
+    // frees rows after they are stored
+    void clear()
+    {
+        std::vector<Letter>().swap(letters);
+        std::vector<Bitmap>().swap(bitmaps);
+        std::unordered_set<unsigned long long>().swap(bitmap_hashes);
+    }
+
+    int type; // 0 - not known, 1 - sjbz, 2 - djbz
+    int w, h, version, dpi;
+    const char* djbz_name; // entry name of INCLuded dictionary, not own
+    bool store_bitmaps;
+    std::vector<Letter> letters;
+    std::vector<Bitmap> bitmaps;
+private:
+    unsigned long long add_bitmap(mdjvu_bitmap_t bitmap, bool new_bitmap);
+
+    std::unordered_set<unsigned long long> bitmap_hashes; // of bitmaps
+    std::vector<unsigned char> packed; // scratch
+};
+
+// Fills FormRecord from JB2 events
+class FormRecordVisitor: public JB2Visitor
+{
+public:
+    explicit FormRecordVisitor(FormRecord& rec): m_rec(rec) {}
+    void dictionary(const JB2Form& form, int32 /*shared_count*/)
+    {
+        m_rec.djbz_name = form.dictionary;
+    }
+    void record(const JB2Form& /*form*/, const JB2Record& r)
+    {
+        if (!r.bitmap) { // not a letter
+            return;
+        }
+        m_rec.add_letter(r.local_id, r.x, r.y, r.w, r.h, r.to_image, r.to_library, r.non_symbol,
+                         r.match, r.from_shared, r.match >= 0, r.filename,
+                         r.bits, r.index_bits, r.bitmap, r.new_bitmap);
+    }
+private:
+    FormRecord& m_rec;
+};
+
+#endif // FORMRECORD_H
@@ -0,0 +1,243 @@
+#include "incremental.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_ID_Sjbz     0x536A627A
+#define CHUNK_ID_Djbz     0x446A627A
+#define CHUNK_ID_INCL     0x494E434C
+#define CHUNK_ID_INFO     0x494E464F
+
+static const char INCREMENTAL_MAGIC[] = "djvudict-incremental 2";
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const unsigned char* data, uint32 length)
+{
+    for (uint32 i = 0; i < length; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// false for a line without newline, the rest of an interrupted write
+static bool read_line(FILE* f, std::string& line)
+{
+    char buf[4096];
+    line.clear();
+    while (fgets(buf, sizeof(buf), f)) {
+        line += buf;
+        if (line[line.length() - 1] == '\n') {
+            line.erase(line.length() - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string options_line(const Options* opts)
+{
+    char res[64];
+    snprintf(res, sizeof(res), "options %d %d %d %d", opts->write_manifest, opts->stats_only,
+             opts->output_format, opts->save_to_sql);
+    return res;
+}
+
+static void write_header(FILE* f, const Options* opts)
+{
+    fprintf(f, "%s\n%s\n", INCREMENTAL_MAGIC, options_line(opts).c_str());
+}
+
+static void write_entry(FILE* f, const IncrementalManifest::Entry& e)
+{
+    fprintf(f, "entry\t%s\t%016llx\t%016llx\t%d\ncounters", e.name.c_str(),
+            (unsigned long long) e.hash, (unsigned long long) e.dict_hash, (int) e.files.size());
+    for (int i = 0; i < Counters::LastCounter; i++) {
+        const Counters::CountersType cntr = (Counters::CountersType) i;
+        fprintf(f, "%c%d %.17g", i ? ' ' : '\t', e.counters.page(cntr), e.counters.pageSize(cntr));
+    }
+    fprintf(f, "\n");
+    for (size_t i = 0; i < e.files.size(); i++) {
+        fprintf(f, "%s\n", e.files[i].c_str());
+    }
+}
+
+uint64_t IncrementalManifest::formHash(const DjVuDocument& doc, const ChunkView& form)
+{
+    uint64_t h = 14695981039346656037ULL;
+    h = hash_bytes(h, form.data, 4); // DJVU, DJVI...
+    ChunkView chunk;
+    for (bool has_chunk = doc.firstChild(form, &chunk); has_chunk; has_chunk = doc.nextSibling(form, &chunk)) {
+        // only chunks the dump reads, so a re-encoded background doesn't count
+        if (chunk.id == CHUNK_ID_INFO || chunk.id == CHUNK_ID_INCL ||
+                chunk.id == CHUNK_ID_Sjbz || chunk.id == CHUNK_ID_Djbz) {
+            const unsigned char header[8] = {
+                (unsigned char) (chunk.id >> 24), (unsigned char) (chunk.id >> 16),
+                (unsigned char) (chunk.id >> 8), (unsigned char) chunk.id,
+                (unsigned char) (chunk.length >> 24), (unsigned char) (chunk.length >> 16),
+                (unsigned char) (chunk.length >> 8), (unsigned char) chunk.length
+            };
+            h = hash_bytes(h, header, sizeof(header));
+            h = hash_bytes(h, chunk.data, chunk.length);
+        }
+    }
+    return h;
+}
+
+bool IncrementalManifest::supports(const Options* opts)
+{
+    // columns and symbols.pack are written anew by every run and would
+    // miss the skipped entries, SQL rows of kept entries stay in the database.
+    // A run of selected entries would drop records of the others.
+    return !opts->write_columns && opts->output_format != OutputPack && !opts->pages && !opts->entries;
+}
+
+bool IncrementalManifest::load(const std::string& filename, const Options* opts)
+{
+    m_entries.clear();
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::string line;
+    if (!read_line(f, line) || line != INCREMENTAL_MAGIC || !read_line(f, line) || line != options_line(opts)) {
+        fclose(f);
+        return false;
+    }
+
+    // the record being written when the run was killed is dropped
+    bool ok = true;
+    bool truncated = false;
+    while (ok && !truncated) {
+        if (!read_line(f, line)) {
+            break;
+        }
+        Entry entry;
+        char* p = &line[0];
+        // entry <name> <hash> <dict_hash> <files>
+        char* fields[5];
+        for (int i = 0; i < 5; i++) {
+            fields[i] = p;
+            p = strchr(p, '\t');
+            if (p) {
+                *p++ = 0;
+            } else if (i < 4) {
+                ok = false;
+                break;
+            } else {
+                break;
+            }
+        }
+        if (!ok || strcmp(fields[0], "entry")) {
+            ok = false;
+            break;
+        }
+        entry.name = fields[1];
+        entry.hash = strtoull(fields[2], NULL, 16);
+        entry.dict_hash = strtoull(fields[3], NULL, 16);
+        const long files = strtol(fields[4], NULL, 10);
+
+        if (!read_line(f, line)) {
+            truncated = true;
+            break;
+        }
+        if (line.compare(0, 9, "counters\t")) {
+            ok = false;
+            break;
+        }
+        const char* c = line.c_str() + 9;
+        for (int i = 0; i < Counters::LastCounter && ok; i++) {
+            char* end;
+            const long val = strtol(c, &end, 10);
+            const double size = strtod(end, &end);
+            if (end == c) {
+                ok = false;
+            }
+            entry.counters.count((Counters::CountersType) i, size, val);
+            c = end;
+        }
+        for (long i = 0; i < files && !truncated; i++) {
+            truncated = !read_line(f, line);
+            entry.files.push_back(line);
+        }
+        if (ok && !truncated) {
+            m_entries[entry.name] = entry;
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Warning: %s is damaged, only its first %d records are used\n",
+                filename.c_str(), (int) m_entries.size());
+    }
+    return true;
+}
+
+bool IncrementalManifest::save(const std::string& filename, const Options* opts)
+{
+    close();
+    const std::string tmp_name = filename + ".tmp";
+    FILE* f = fopen(tmp_name.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    write_header(f, opts);
+    for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        write_entry(f, it->second);
+    }
+    const bool failed = ferror(f) != 0;
+    if (fclose(f) || failed) {
+        remove(tmp_name.c_str());
+        return false;
+    }
+#if (defined(windows) || defined(WIN32))
+    remove(filename.c_str()); // rename() doesn't replace files
+#endif
+    if (rename(tmp_name.c_str(), filename.c_str())) {
+        remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool IncrementalManifest::begin(const std::string& filename, const Options* opts)
+{
+    if (!save(filename, opts)) {
+        return false;
+    }
+    m_file = fopen(filename.c_str(), "ab");
+    return m_file != NULL;
+}
+
+bool IncrementalManifest::append(const Entry& entry)
+{
+    add(entry);
+    if (!m_file) {
+        return false;
+    }
+    write_entry(m_file, entry);
+    // a killed process loses nothing written to the system
+    return fflush(m_file) == 0 && !ferror(m_file);
+}
+
+void IncrementalManifest::close()
+{
+    if (m_file) {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+const IncrementalManifest::Entry* IncrementalManifest::find(const std::string& name) const
+{
+    std::map<std::string, Entry>::const_iterator it = m_entries.find(name);
+    return it == m_entries.end() ? NULL : &it->second;
+}
+
+void IncrementalManifest::add(const Entry& entry)
+{
+    m_entries[entry.name] = entry;
+}
+
+void IncrementalManifest::erase(const std::string& name)
+{
+    m_entries.erase(name);
+}
@@ -0,0 +1,65 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "jb2dumper.h"
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * incremental.manifest in the output folder (-incremental, -resume): what the
+ * previous run dumped for every entry, so an entry whose JB2 data and
+ * dictionary didn't change keeps its folder (and SQL rows) and its counters
+ * are taken from here. It's also the checkpoint of a run: a record is
+ * appended as soon as an entry is committed, a truncated record at the end
+ * is ignored.
+ *
+ *   djvudict-incremental 2
+ *   options <write_manifest> <stats_only> <output_format> <save_to_sql>
+ * and for every entry:
+ *   entry <folder name> <hash> <dictionary hash> <files count>   (tab separated)
+ *   counters <count> <size> ...                                  (LastCounter pairs)
+ *   <file>                                                       (files count lines)
+ * Hashes are hexadecimal, files are relative to the output folder.
+ */
+class IncrementalManifest
+{
+public:
+    struct Entry
+    {
+        std::string name;       // folder of the entry, get_subdir_name()
+        uint64_t hash;          // of INFO, INCL, Sjbz and Djbz chunks of the form
+        uint64_t dict_hash;     // hash of the INCLuded dictionary entry or 0
+        Counters counters;      // page counters of the entry
+        std::vector<std::string> files;
+    };
+
+    static uint64_t formHash(const DjVuDocument& doc, const ChunkView& form);
+    // outputs of the previous run are reused only with the same options
+    static bool supports(const Options* opts);
+
+    IncrementalManifest(): m_file(NULL) {}
+    ~IncrementalManifest() { close(); }
+
+    // false if there is no manifest or it was written with other options
+    bool load(const std::string& filename, const Options* opts);
+    // written under a temporary name and renamed
+    bool save(const std::string& filename, const Options* opts);
+    // saves the entries and keeps the file open for append()
+    bool begin(const std::string& filename, const Options* opts);
+    // adds the entry and writes it out at once
+    bool append(const Entry& entry);
+    void close();
+
+    const Entry* find(const std::string& name) const;
+    void add(const Entry& entry);
+    void erase(const std::string& name);
+    inline const std::map<std::string, Entry>& entries() const { return m_entries; }
+
+private:
+    std::map<std::string, Entry> m_entries;
+    FILE* m_file; // open by begin()
+};
+
+#endif // INCREMENTAL_H
@@ -0,0 +1,192 @@
+#include "inventory.h"
+#include "pathutils.h"
+#include "phasetimes.h"
+#include <string.h>
+
+#define CHUNK_ID_INCL     0x494E434C
+#define CHUNK_ID_INFO     0x494E464F
+
+static std::string chunk_name(uint32 id)
+{
+    std::string res(4, ' ');
+    for (int i = 0; i < 4; i++) {
+        const unsigned char c = (id >> (24 - 8 * i)) & 0xFF;
+        res[i] = (c >= 0x20 && c < 0x7F) ? c : '?';
+    }
+    return res;
+}
+
+static const char* entry_type_name(DIRM_EntryType type)
+{
+    switch (type) {
+    case SharedFile: return "shared";
+    case Page: return "page";
+    case Thumbnails: return "thumbnails";
+    }
+    return "unknown";
+}
+
+void Inventory::addChunk(std::vector<ChunkSize>& chunks, uint32 id, uint32 length)
+{
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].id == id) {
+            chunks[i].count++;
+            chunks[i].bytes += length;
+            return;
+        }
+    }
+    ChunkSize size = { id, 1, length };
+    chunks.push_back(size);
+}
+
+bool Inventory::read(const DjVuDocument& doc, const DIRM_Entry* entries, int count, bool bundled, mdjvu_error_t *perr)
+{
+    m_size = doc.size();
+    m_bundled = bundled;
+    m_entries.clear();
+    m_totals.clear();
+    m_entries.reserve(count);
+
+    for (int i = 0; i < count; i++) {
+        ChunkView FORM;
+        if (!doc.readChunk(entries[i].offset, &FORM) || FORM.id != CHUNK_ID_FORM || FORM.length < 4) {
+            fprintf(stderr, "No FORM tag found at %u.\n", entries[i].offset);
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return false;
+        }
+
+        Entry entry;
+        entry.position = i;
+        entry.dirm = &entries[i];
+        entry.form_type = read_uint32_most_significant_byte_first_buf(FORM.data);
+        entry.has_info = false;
+        entry.width = entry.height = entry.version = entry.dpi = 0;
+
+        ChunkView chunk;
+        for (bool has_chunk = doc.firstChild(FORM, &chunk); has_chunk; has_chunk = doc.nextSibling(FORM, &chunk)) {
+            addChunk(entry.chunks, chunk.id, chunk.length);
+            addChunk(m_totals, chunk.id, chunk.length);
+            if (chunk.id == CHUNK_ID_INFO && chunk.length >= 10 && !entry.has_info) {
+                const unsigned char* info = chunk.data;
+                entry.has_info = true;
+                entry.width = info[1] | info[0] << 8;
+                entry.height = info[3] | info[2] << 8;
+                entry.version = (info[5] << 8) + info[4];
+                entry.dpi = info[6] | info[7] << 8;
+            } else if (chunk.id == CHUNK_ID_INCL) {
+                entry.incl.push_back(std::string((const char*) chunk.data, chunk.length));
+            }
+        }
+        m_entries.push_back(entry);
+    }
+    return true;
+}
+
+void Inventory::writeText(FILE* f, const char* document) const
+{
+    int pages = 0, shared = 0, thumbnails = 0;
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        switch (m_entries[i].dirm->type) {
+        case Page: pages++; break;
+        case SharedFile: shared++; break;
+        case Thumbnails: thumbnails++; break;
+        }
+    }
+    fprintf(f, "document: %s\n", document);
+    fprintf(f, "size: %u bytes, %s, %d entries (%d pages, %d shared, %d thumbnails)\n",
+            m_size, m_bundled ? "bundled" : "single-page", (int) m_entries.size(), pages, shared, thumbnails);
+    fprintf(f, "chunks:");
+    for (size_t i = 0; i < m_totals.size(); i++) {
+        fprintf(f, " %s %llu (%u)", chunk_name(m_totals[i].id).c_str(),
+                (unsigned long long) m_totals[i].bytes, m_totals[i].count);
+    }
+    fprintf(f, "\n\n");
+
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        const Entry& e = m_entries[i];
+        fprintf(f, "%d %s %s %s offset %u size %u", e.position, e.dirm->id_str,
+                entry_type_name(e.dirm->type), chunk_name(e.form_type).c_str(), (uint32) e.dirm->offset, (uint32) e.dirm->size);
+        if (e.has_info) {
+            fprintf(f, " %dx%d dpi %d v%d", e.width, e.height, e.dpi, e.version);
+        }
+        for (size_t j = 0; j < e.incl.size(); j++) {
+            fprintf(f, " INCL %s", e.incl[j].c_str());
+        }
+        fprintf(f, "\n   ");
+        for (size_t j = 0; j < e.chunks.size(); j++) {
+            fprintf(f, " %s %llu", chunk_name(e.chunks[j].id).c_str(), (unsigned long long) e.chunks[j].bytes);
+            if (e.chunks[j].count > 1) {
+                fprintf(f, " (%u)", e.chunks[j].count);
+            }
+        }
+        fprintf(f, "\n");
+    }
+}
+
+static void write_json_chunks(FILE* f, const std::vector<Inventory::ChunkSize>& chunks)
+{
+    fprintf(f, "{");
+    for (size_t i = 0; i < chunks.size(); i++) {
+        fprintf(f, "%s%s: {\"count\": %u, \"bytes\": %llu}", i ? ", " : "",
+                json_string(chunk_name(chunks[i].id).c_str()).c_str(),
+                chunks[i].count, (unsigned long long) chunks[i].bytes);
+    }
+    fprintf(f, "}");
+}
+
+void Inventory::writeJson(FILE* f, const char* document) const
+{
+    fprintf(f, "{\n  \"document\": %s,\n  \"size\": %u,\n  \"bundled\": %s,\n  \"chunks\": ",
+            json_string(document).c_str(), m_size, m_bundled ? "true" : "false");
+    write_json_chunks(f, m_totals);
+    fprintf(f, ",\n  \"entries\": [");
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        const Entry& e = m_entries[i];
+        fprintf(f, "%s\n    {\"position\": %d, \"id\": %s, \"type\": \"%s\", \"form\": %s, \"offset\": %u, \"size\": %u",
+                i ? "," : "", e.position, json_string(e.dirm->id_str).c_str(), entry_type_name(e.dirm->type),
+                json_string(chunk_name(e.form_type).c_str()).c_str(), (uint32) e.dirm->offset, (uint32) e.dirm->size);
+        if (e.has_info) {
+            fprintf(f, ", \"width\": %d, \"height\": %d, \"dpi\": %d, \"version\": %d",
+                    e.width, e.height, e.dpi, e.version);
+        }
+        if (!e.incl.empty()) {
+            fprintf(f, ", \"incl\": [");
+            for (size_t j = 0; j < e.incl.size(); j++) {
+                fprintf(f, "%s%s", j ? ", " : "", json_string(e.incl[j].c_str()).c_str());
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, ", \"chunks\": ");
+        write_json_chunks(f, e.chunks);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+bool Inventory::save(const char* out_path, const char* document, mdjvu_error_t *perr) const
+{
+    if (mkpath(out_path)) {
+        fprintf(stderr, "Can't create %s\n", out_path);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    const std::string names[2] = { get_statsname(out_path, "inventory.txt"), get_statsname(out_path, "inventory.json") };
+    for (int i = 0; i < 2; i++) {
+        FILE* f = fopen(names[i].c_str(), "wb");
+        if (!f) {
+            fprintf(stderr, "Can't create %s\n", names[i].c_str());
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+            return false;
+        }
+        if (i == 0) {
+            writeText(f, document);
+        } else {
+            writeJson(f, document);
+        }
+        if (fclose(f)) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include "djvudirreader.h"
+#include "djvudocument.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Structure of a document (inventory.txt and inventory.json) read from
+ * DIRM, IFF chunk headers and INFO/INCL payloads only. No JB2 or other
+ * chunk is decoded, so a document takes milliseconds.
+ */
+class Inventory
+{
+public:
+    // sizes of chunks with the same id, in order of first appearance
+    struct ChunkSize
+    {
+        uint32 id;
+        uint32 count;
+        uint64_t bytes; // payload bytes
+    };
+
+    struct Entry
+    {
+        int position;          // in DIRM
+        const DIRM_Entry* dirm;
+        uint32 form_type;      // ID_DJVU, ID_DJVI...
+        bool has_info;
+        int width, height, version, dpi;
+        std::vector<std::string> incl; // ids of INCLuded dictionaries
+        std::vector<ChunkSize> chunks;
+    };
+
+    Inventory(): m_size(0), m_bundled(false) {}
+
+    // reads entries of a bundled (or the single entry of a single-page) document
+    bool read(const DjVuDocument& doc, const DIRM_Entry* entries, int count, bool bundled, mdjvu_error_t *perr);
+    void writeText(FILE* f, const char* document) const;
+    void writeJson(FILE* f, const char* document) const;
+
+    // writes inventory.txt and inventory.json to out_path
+    bool save(const char* out_path, const char* document, mdjvu_error_t *perr) const;
+
+private:
+    static void addChunk(std::vector<ChunkSize>& chunks, uint32 id, uint32 length);
+
+    uint32 m_size;
+    bool m_bundled;
+    std::vector<Entry> m_entries;
+    std::vector<ChunkSize> m_totals; // over all entries
+};
+
+#endif // INVENTORY_H
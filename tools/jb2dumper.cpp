@@ -6,109 +6,24 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <memory>
+#include <algorithm>
 
-#include "../src/jb2/zp.h"
+#include "zpstream.h"
 #include "../src/jb2/jb2coder.h"
-
-#if (defined(windows) || defined(WIN32))
-#include <windows.h>
-#include <direct.h>
-#define mkdir(dir, mode) _mkdir(dir)
-const char _dir_sep = '\\';
-#else
-#include <sys/stat.h>
-const char _dir_sep = '/';
-#endif
-
-#ifdef HAVE_LIBSQLITE3
-static int _save_to_sql = 0;
-#endif
-
-static char dir_sep_used(const std::string& s)
-{
-    const bool slash = s.find_first_of('/',0) !=std::string::npos;
-    const bool backslash = s.find_first_of('\\',0) !=std::string::npos;
-    if (slash != backslash) return slash? '/' : '\\';
-    return _dir_sep;
-}
-
-static int mkpath(std::string path, int mode = 0755)
-{
-    char used_sep = dir_sep_used(path);
-
-    if (path.empty()) {
-        return 0;
-    }
-
-
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-
-    int pos = 0, res = 0;
-    while( (pos = path.find_first_of(used_sep, pos) ) != std::string::npos ) {
-        std::string dir = path.substr(0, pos++);
-        if (dir.size()) {
-            res = mkdir(dir.c_str(), mode);
-            if (res == -1 && errno != EEXIST) {
-                fprintf(stderr, "mkdir failed for %s (error code %u, errno: %d - %s)", path.data(), res, errno, strerror(errno));
-                return res;
-            }
-        }
-    }
-    return 0;
-}
-
-static std::string get_subdir(std::string path, const std::string dir, int id)
-{
-    char used_sep = dir_sep_used(path);
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-    return path + std::to_string(id) + '_' + dir + used_sep;
-}
-
-static std::string get_filename(std::string path, std::string name)
-{
-    char used_sep = dir_sep_used(path);
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-    return path + name + ".bmp";
-}
-
-static std::string get_filename(std::string path, std::string prefix, int id, int padding = 5)
-{
-    char used_sep = dir_sep_used(path);
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-    std::string num = std::to_string(id);
-    while (num.length() < padding) num = '0' + num;
-
-    if (!prefix.empty()) prefix += '_';
-    return path + prefix + num + ".bmp";
-}
-
-static std::string get_statsname(std::string path, std::string filename)
-{
-    char used_sep = dir_sep_used(path);
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-    return path + filename;
-}
-
-static std::string get_sqlname(std::string path)
-{
-    char used_sep = dir_sep_used(path);
-    if ( path[path.length()-1] != used_sep) {
-        path += used_sep;
-    }
-    return path + "djvu_sqlite.db";
-}
-
-JB2Dumper::JB2Dumper(): m_shared_dicts(NULL), m_shared_dict_cnt(0), m_dict_buf_allocated(0), m_cur_dpi(600), m_cur_entry_no(0)
+#include "workerpool.h"
+#include "bitmapwriter.h"
+#include "packarchive.h"
+#include "pathutils.h"
+#include "incremental.h"
+#include "selection.h"
+#include <map>
+#include <set>
+
+JB2Dumper::JB2Dumper(): m_shared_dicts(NULL), m_shared_dict_cnt(0), m_opts(NULL), m_writer(NULL),
+    m_save_to_sql(false), m_collect_records(false), m_visitor(NULL), m_track_files(false),
+    m_manifest(NULL), m_previous(NULL), m_dict_memory(0), m_dict_memory_peak(0),
+    m_dict_memory_max(0), m_dict_budget(0), m_dicts_decoding(0)
 {
 }
 
@@ -121,30 +36,24 @@ void JB2Dumper::close()
 {
     if (m_shared_dict_cnt) {
         for (int32 i = 0; i < m_shared_dict_cnt; i++) {
-            SharedDictInfo& dict = m_shared_dicts[i];
-            if (dict.bitmaps) {
-                for (int32 j = 0; j < dict.count; j++) {
-                    mdjvu_bitmap_destroy(dict.bitmaps[j]);
-                }
-                free(dict.bitmaps);
-            }
+            freeDict(m_shared_dicts[i]);
         }
         free(m_shared_dicts);
-        m_dict_buf_allocated = 0;
+        m_shared_dicts = NULL;
         m_shared_dict_cnt = 0;
     }
+    m_dict_memory = 0;
 }
 
-static mdjvu_bitmap_t * clone_library(mdjvu_bitmap_t * library, int32 size)
+void JB2Dumper::freeDict(SharedDictInfo& dict)
 {
-    if (!library || size == 0) {
-        return NULL;
+    if (dict.bitmaps) {
+        free(dict.bitmaps);
     }
-    mdjvu_bitmap_t * res = (mdjvu_bitmap_t *) malloc(size * sizeof(mdjvu_bitmap_t));
-    for (int32 i = 0; i < size; i++) {
-        res[i] = mdjvu_bitmap_clone(library[i]);
+    if (dict.image) {
+        mdjvu_image_destroy(dict.image);
     }
-    return res;
+    memset(&dict, 0, sizeof(dict));
 }
 
 ////////////////////////////////////////
@@ -164,6 +73,70 @@ append_to_list(T *&list, int32 &count, int32 &allocated)
     return &list[count++];
 }
 
+// Library of a JB2 image. Symbols of shared dictionary are referenced,
+// not copied, so using a dictionary costs O(1). Bitmaps aren't owned,
+// they belong to images they were decoded in.
+class SymbolLibrary
+{
+public:
+    SymbolLibrary(): m_shared(NULL), m_shared_count(0), m_local(NULL), m_local_count(0), m_local_alloc(0) {}
+    ~SymbolLibrary() { free(m_local); }
+
+    void useShared(const mdjvu_bitmap_t* bitmaps, int32 count)
+    {
+        m_shared = bitmaps;
+        m_shared_count = count;
+        m_shared_saved.assign(count, false);
+    }
+
+    void add(mdjvu_bitmap_t bitmap)
+    {
+        *(append_to_list<mdjvu_bitmap_t>(m_local, m_local_count, m_local_alloc)) = bitmap;
+        m_saved.push_back(false);
+    }
+
+    // tracks which symbols already have a file (or manifest record) for this image
+    inline bool isSaved(int32 i) const
+    {
+        return i < m_shared_count ? m_shared_saved[i] : m_saved[i - m_shared_count];
+    }
+    inline void setSaved(int32 i)
+    {
+        if (i < m_shared_count) {
+            m_shared_saved[i] = true;
+        } else {
+            m_saved[i - m_shared_count] = true;
+        }
+    }
+
+    inline mdjvu_bitmap_t operator[](int32 i) const
+    {
+        return i < m_shared_count ? m_shared[i] : m_local[i - m_shared_count];
+    }
+
+    inline int32 count() const { return m_shared_count + m_local_count; }
+    inline mdjvu_bitmap_t last() const { return (*this)[count() - 1]; }
+
+    // passes list of own (not shared) symbols to the caller
+    mdjvu_bitmap_t* releaseLocal(int32* count)
+    {
+        mdjvu_bitmap_t* res = m_local;
+        *count = m_local_count;
+        m_local = NULL;
+        m_local_count = m_local_alloc = 0;
+        m_saved.clear();
+        return res;
+    }
+private:
+    const mdjvu_bitmap_t* m_shared;
+    int32 m_shared_count;
+    mdjvu_bitmap_t* m_local;
+    int32 m_local_count;
+    int32 m_local_alloc;
+    std::vector<bool> m_saved;
+    std::vector<bool> m_shared_saved;
+};
+
 static mdjvu_bitmap_t decode_lib_shape/*{{{*/
 (JB2Decoder &jb2, mdjvu_image_t img, bool with_blit, mdjvu_bitmap_t proto, int32 *img_x = 0, int32 *img_y = 0)
 {
@@ -193,68 +166,210 @@ static mdjvu_bitmap_t decode_lib_shape/*{{{*/
 }/*}}}*/
 
 
+// visitors get endForm() for the part decoded before the error
 #define COMPLAIN \
 { \
     if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_jb2); \
+    end_form(); \
     return NULL; \
     }
 //
 ////////////////////////////////////////
 
-// function below is a modified mdjvu_file_load_jb2() from  jb2load.cpp
+// Position of the ZP decoder in the compressed stream, in bits. Take the bytes
+// read less the bits still waiting in the buffer and in the 16-bit code register,
+// plus the information already taken from the current interval (its width is
+// 0x10000 - a). Past the end of the stream the decoder loads 0xff bytes that
+// raise scount but aren't read, so the position is kept from going back.
+class ZPPosition
+{
+public:
+    ZPPosition(const ZPDecoder& zp, int32 length): m_zp(zp), m_length(length), m_last(0) {}
+    double operator()()
+    {
+        const double bits = (double) zp_consumed_bytes(m_zp, m_length) * 8 - m_zp.get_scount() - 16;
+        const double pos = bits + log2(65536.0 / (65536.0 - m_zp.get_a()));
+        m_last = pos > m_last ? pos : m_last;
+        return m_last;
+    }
+private:
+    const ZPDecoder& m_zp;
+    int32 m_length;
+    double m_last;
+};
+
+// to_library: the refined shape is added to the library, these records
+// aren't counted as dictionary usage
+static void count_match(Counters& counters, bool shared, bool to_library, double record_bits, double index_bits)
+{
+    if (to_library) {
+        counters.count(shared ? Counters::SharedDictRefinements : Counters::LocalDictRefinements, record_bits);
+    } else {
+        counters.count(shared ? Counters::SharedDictUsage : Counters::LocalDictUsage, record_bits);
+    }
+    counters.count(Counters::MatchingSymbolIndex, index_bits);
+    counters.count(Counters::MatchedSymbolPayload, record_bits - index_bits);
+}
+
+// Bitmap files (or symbols.pack entries) of the records that decode a bitmap
+class BitmapSaver: public JB2Visitor
+{
+public:
+    BitmapSaver(BitmapWriter* writer, DumpContext& ctx, bool track_files):
+        m_writer(writer), m_ctx(ctx), m_track_files(track_files) {}
+    void record(const JB2Form& /*form*/, const JB2Record& r)
+    {
+        if (!r.bitmap || !r.new_bitmap) { // copies refer to files saved before
+            return;
+        }
+        const SymbolKey key = r.to_library ? SymbolKey{m_ctx.entry_no, SymbolLib, r.local_id} :
+                              r.non_symbol ? SymbolKey{m_ctx.entry_no, SymbolNonSymb, r.image_index} :
+                                             SymbolKey{m_ctx.entry_no, SymbolImg, r.image_index};
+        PhaseTimer timer(&m_ctx.times, PhaseTimes::BitmapSave);
+        m_writer->save(r.bitmap, key, r.filename, m_ctx.dpi);
+        if (m_track_files) {
+            m_ctx.files.push_back(r.filename);
+        }
+    }
+private:
+    BitmapWriter* m_writer;
+    DumpContext& m_ctx;
+    bool m_track_files;
+};
+
+// actions.log of the form
+class ActionsLogger: public JB2Visitor
+{
+public:
+    ActionsLogger(const std::string& filename, PhaseTimes* times)
+    {
+        m_log.setTimes(times);
+        m_log.open(filename.data());
+    }
+    void record(const JB2Form& /*form*/, const JB2Record& r)
+    {
+        if (!r.bitmap) {
+            m_log.logAction(r.type);
+            return;
+        }
+        // library records are logged by their index, image records by the
+        // bitmap they decode or the symbol they copy
+        const int32 idx = r.to_library ? r.local_id : r.new_bitmap ? r.image_index : r.match;
+        const bool shared = !r.to_library && r.from_shared;
+        if (r.to_image) {
+            m_log.logAction(r.type, idx, shared, r.x, r.y);
+        } else {
+            m_log.logAction(r.type, idx, shared);
+        }
+    }
+private:
+    LogFile m_log;
+};
 
-mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, const char* out_path, mdjvu_error_t *perr)
+// Outputs of a form made from its events
+struct FormOutputs
+{
+    explicit FormOutputs(DumpContext& ctx): collector(ctx.record) {}
+    FormRecordVisitor collector;        // rows for SQL and columns
+    std::unique_ptr<BitmapSaver> saver;
+    std::unique_ptr<ActionsLogger> actions;
+    std::vector<JB2Visitor*> visitors;  // with the embedding visitor
+};
+
+void JB2Dumper::attachOutputs(DumpContext& ctx, FormOutputs& outputs)
 {
-    if (perr) *perr = NULL;
+    if (m_collect_records) {
+        outputs.visitors.push_back(&outputs.collector);
+    }
+    if (!m_opts->stats_only) {
+        if (m_opts->output_format != OutputSQL) { // else bitmaps go to SQL rows
+            outputs.saver.reset(new BitmapSaver(m_writer, ctx, m_track_files));
+            outputs.visitors.push_back(outputs.saver.get());
+        }
+        outputs.actions.reset(new ActionsLogger(get_statsname(ctx.dump_path, "actions.log"), &ctx.times));
+        outputs.visitors.push_back(outputs.actions.get());
+    }
+    if (m_visitor) {
+        outputs.visitors.push_back(m_visitor);
+    }
+}
 
-    m_counters.resetPageCounters();
+// function below is a modified mdjvu_file_load_jb2() from  jb2load.cpp
 
-    LogFile log(&m_counters);
-    log.open(get_statsname(out_path, "stats.log").data());
-    LogFile actions;
-    actions.open(get_statsname(out_path, "actions.log").data());
+mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, DumpContext& ctx)
+{
+    mdjvu_error_t *perr = &ctx.err;
+    *perr = NULL;
+    const char* out_path = ctx.dump_path.c_str();
+    Counters& counters = ctx.counters;
+
+    LogFile log(&counters);
+    log.open(ctx.stats_file.data());
+
+    FormOutputs outputs(ctx);
+    attachOutputs(ctx, outputs);
+    std::vector<JB2Visitor*>& visitors = outputs.visitors;
+    if (ctx.trace) visitors.push_back(ctx.trace);
+    auto visit = [&visitors, &ctx](const JB2Record& rec) {
+        for (size_t v = 0; v < visitors.size(); v++) {
+            visitors[v]->record(ctx.info, rec);
+        }
+    };
+    // records without a shape
+    auto visit_plain = [&visit, &visitors](int32 type, double bits, int32 w, int32 h) {
+        if (!visitors.empty()) {
+            visit(JB2Record{type, -1, 0, 0, w, h, false, false, false, -1, false, bits, 0, NULL, false, "", -1});
+        }
+    };
+    for (size_t v = 0; v < visitors.size(); v++) {
+        visitors[v]->beginForm(ctx.info);
+    }
 
     JB2Decoder jb2(f, length);
     ZPDecoder &zp = jb2.zp;
+    ZPPosition zp_position(zp, length);
+    auto end_form = [&visitors, &ctx, &zp_position]() {
+        for (size_t v = 0; v < visitors.size(); v++) {
+            visitors[v]->endForm(ctx.info, zp_position());
+        }
+    };
 
     int32 t = jb2.decode_record_type();
-    m_counters.count((Counters::CountersType)t);
-    actions.logAction(t);
+    counters.count((Counters::CountersType)t);
 
-    int32 lib_count = 0, lib_alloc = 128;
-    mdjvu_bitmap_t * library = NULL;
+    SymbolLibrary library;
 
     int32 shared_lib_size_used = 0;
 
+    double header_start = 0;
     if (t == jb2_require_dictionary_or_reset)
     {
-        lib_alloc = lib_count = zp.decode(jb2.required_dictionary_size);
-        shared_lib_size_used = lib_count;
-        log.log("Using shared dictionary with size:\t%u\n", lib_count);
+        shared_lib_size_used = zp.decode(jb2.required_dictionary_size);
+        visit_plain(t, zp_position(), shared_lib_size_used, 0);
+        header_start = zp_position();
+        log.log("Using shared dictionary with size:\t%u\n", shared_lib_size_used);
         if (! shared_library || !shared_library->count) {
-            fprintf(stderr, "JB2 Image requires %u images from shared library which wasn't provided\n", lib_count);
+            fprintf(stderr, "JB2 Image requires %u images from shared library which wasn't provided\n", shared_lib_size_used);
             if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_jb2);
             //COMPLAIN;
         }
 
-        if (shared_library) {
-            if (shared_library->count < lib_count) {
-                fprintf(stderr, "JB2 Image requires %u images but shared library has only", shared_library->count);
+        if (!shared_library) {
+            shared_lib_size_used = 0;
+        } else {
+            if (shared_library->count < shared_lib_size_used) {
+                fprintf(stderr, "JB2 Image requires %u images but shared library has only %u\n", shared_lib_size_used, shared_library->count);
                 COMPLAIN;
             }
-            library = clone_library(shared_library->bitmaps, lib_count);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                m_sql.use_djbz(shared_library->id);
+            library.useShared(shared_library->bitmaps, shared_lib_size_used);
+            for (size_t v = 0; v < visitors.size(); v++) {
+                visitors[v]->dictionary(ctx.info, shared_lib_size_used);
             }
-#endif
         }
         t = jb2.decode_record_type(); // read jb2_start_of_image
-        m_counters.count((Counters::CountersType)t);
-        actions.logAction(t);
+        counters.count((Counters::CountersType)t);
     } else {
-        log.log("Using local dictionary\n", lib_count);
-        library = (mdjvu_bitmap_t *) malloc(lib_alloc * sizeof(mdjvu_bitmap_t));
+        log.log("Using local dictionary\n");
     }
 
     if (t != jb2_start_of_image) COMPLAIN;
@@ -262,73 +377,66 @@ mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const Share
     const int32 page_w = zp.decode(jb2.image_size);
     const int32 page_h = zp.decode(jb2.image_size);
     zp.decode(jb2.eventual_image_refinement); // dropped
+    visit_plain(t, zp_position() - header_start, page_w, page_h);
     jb2.symbol_column_number.set_interval(1, !page_w?1:page_w);
     jb2.symbol_row_number.set_interval(1, !page_h?1:page_h);
 
     mdjvu_image_t img = mdjvu_image_create(page_w, page_h); /* d is dropped for now - XXX*/
 
+    FILE* manifest = NULL; // references to shared dictionary files
+    if (m_opts->write_manifest && !m_opts->stats_only && !local_dict) {
+        manifest = fopen(get_statsname(out_path, "manifest.log").data(), "wb");
+    }
+
     while(1)
     {
+        const double record_start = zp_position();
         t = jb2.decode_record_type();
-        long int size = 0;
+        double size = 0; // compressed bits of the record
         switch(t)
         {
         case jb2_new_symbol_add_to_image_and_library: {
             int32 img_x; int32 img_y;
-            size = ftell(zp.file);
-            *(append_to_list<mdjvu_bitmap_t>(library, lib_count, lib_alloc))
-                    = decode_lib_shape(jb2, img, true, NULL, &img_x, &img_y);
-            const std::string filename = get_filename(out_path, "lib", lib_count-1);
-            mdjvu_save_bmp(library[lib_count-1], filename.data(), m_cur_dpi, perr);
+            library.add(decode_lib_shape(jb2, img, true, NULL, &img_x, &img_y));
+            const std::string filename = get_filename(out_path, "lib", library.count()-1);
+            library.setSaved(library.count()-1);
             if (page_h) {
                 img_y = page_h - img_y; // return (0,0) to left bottom corner
                 assert(img_y >= 0);
             }
-            actions.logAction(t, lib_count-1, false, img_x, img_y);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::BitmapsAddedToLocalDict, size);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                const mdjvu_bitmap_t l_img = library[lib_count-1];
-                const int img_w = mdjvu_bitmap_get_width(l_img);
-                const int img_h = mdjvu_bitmap_get_height(l_img);
-                m_sql.add_letter(lib_count-1, img_x, img_y,  img_w,  img_h,
-                                 1 /*to_image*/, 1 /*to_library*/, 0 /*is_symbol*/,
-                                 -1 /*ref_local_id*/, 0 /*from_djbz*/,
-                                 0 /*is_refinement*/, filename.data());
+            size = zp_position() - record_start;
+            counters.count(Counters::BitmapsAddedToLocalDict, size);
+            if (!visitors.empty()) {
+                const mdjvu_bitmap_t l_img = library.last();
+                visit(JB2Record{t, library.count()-1, img_x, img_y,
+                                mdjvu_bitmap_get_width(l_img), mdjvu_bitmap_get_height(l_img),
+                                true /*to_image*/, true /*to_library*/, false /*non_symbol*/,
+                                -1 /*match*/, false /*from_shared*/, size, 0,
+                                l_img, true, filename.data(), -1});
             }
-#endif
         } break;
         case jb2_new_symbol_add_to_library_only: {
-            size = ftell(zp.file);
-            *(append_to_list<mdjvu_bitmap_t>(library, lib_count, lib_alloc))
-                    = decode_lib_shape(jb2, img, false, NULL);
-
-            const std::string filename = get_filename(out_path, "lib", lib_count-1);
-            mdjvu_save_bmp(library[lib_count-1], filename.data(), m_cur_dpi, perr);
-            actions.logAction(t, lib_count-1, false);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::BitmapsAddedToLocalDict, size);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                const int img_w = mdjvu_bitmap_get_width(library[lib_count-1]);
-                const int img_h = mdjvu_bitmap_get_height(library[lib_count-1]);
-                m_sql.add_letter(lib_count-1, 0, 0,  img_w,  img_h,
-                                 0 /*to_image*/, 1 /*to_library*/, 0 /*is_symbol*/,
-                                 -1 /*ref_local_id*/, 0 /*from_djbz*/,
-                                 0 /*is_refinement*/, filename.data());
+            library.add(decode_lib_shape(jb2, img, false, NULL));
+
+            const std::string filename = get_filename(out_path, "lib", library.count()-1);
+            library.setSaved(library.count()-1);
+            size = zp_position() - record_start;
+            counters.count(Counters::BitmapsAddedToLocalDict, size);
+            if (!visitors.empty()) {
+                visit(JB2Record{t, library.count()-1, 0, 0,
+                                mdjvu_bitmap_get_width(library.last()), mdjvu_bitmap_get_height(library.last()),
+                                false /*to_image*/, true /*to_library*/, false /*non_symbol*/,
+                                -1 /*match*/, false /*from_shared*/, size, 0,
+                                library.last(), true, filename.data(), -1});
             }
-#endif
         } break;
         case jb2_new_symbol_add_to_image_only: {
-            size = ftell(zp.file);
             jb2.decode(img);
             int32 index = mdjvu_image_get_bitmap_count(img);
             jb2.decode_blit(img, index-1);
 
             const std::string filename = get_filename(out_path, "img", index);
             const mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(img, index);
-            mdjvu_save_bmp(bitmap, filename.data(), m_cur_dpi, perr);
 
             int32 last_blit = mdjvu_image_get_blit_count(img) - 1;
             const int x = mdjvu_image_get_blit_x(img, last_blit);
@@ -338,109 +446,90 @@ mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const Share
                 assert(y >= 0);
             }
 
-            actions.logAction(t, index, false, x, y);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::UniqElementsOnPage, size);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                const int img_w = mdjvu_bitmap_get_width(bitmap);
-                const int img_h = mdjvu_bitmap_get_height(bitmap);
-                m_sql.add_letter(-1, x, y,  img_w,  img_h,
-                                 1 /*to_image*/, 0 /*to_library*/, 0 /*is_symbol*/,
-                                 -1 /*ref_local_id*/, 0 /*from_djbz*/,
-                                 0 /*is_refinement*/, filename.data());
+            size = zp_position() - record_start;
+            counters.count(Counters::UniqElementsOnPage, size);
+            if (!visitors.empty()) {
+                visit(JB2Record{t, -1, x, y, mdjvu_bitmap_get_width(bitmap), mdjvu_bitmap_get_height(bitmap),
+                                true /*to_image*/, false /*to_library*/, false /*non_symbol*/,
+                                -1 /*match*/, false /*from_shared*/, size, 0,
+                                bitmap, true, filename.data(), index});
             }
-#endif
         } break;
         case jb2_matched_symbol_with_refinement_add_to_image_and_library: {
-            size = ftell(zp.file);
-            if (!lib_count)
+            if (!library.count())
             {
+                if (manifest) fclose(manifest);
                 mdjvu_image_destroy(img);
-                free(library);
                 COMPLAIN;
             }
-            jb2.matching_symbol_index.set_interval(0, lib_count - 1);
+            jb2.matching_symbol_index.set_interval(0, library.count() - 1);
+            const double index_start = zp_position();
             int32 match = zp.decode(jb2.matching_symbol_index);
+            const double index_bits = zp_position() - index_start;
             int32 img_x; int32 img_y;
-            *(append_to_list<mdjvu_bitmap_t>(library, lib_count, lib_alloc))
-                    = decode_lib_shape(jb2, img, true, library[match], &img_x, &img_y);
+            library.add(decode_lib_shape(jb2, img, true, library[match], &img_x, &img_y));
             if (page_h) {
                 img_y = page_h - img_y; // return (0,0) to left bottom corner
                 assert(img_y >= 0);
             }
 
-            const std::string filename = get_filename(out_path, "lib", lib_count-1);
-            mdjvu_save_bmp(library[lib_count-1], filename.data(), m_cur_dpi, perr);
-            actions.logAction(t, lib_count-1, false, img_x, img_y);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::BitmapsAddedToLocalDict, size);
-
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                const int img_w = mdjvu_bitmap_get_width(library[lib_count-1]);
-                const int img_h = mdjvu_bitmap_get_height(library[lib_count-1]);
-                m_sql.add_letter(lib_count-1, img_x, img_y,  img_w,  img_h,
-                                 1 /*to_image*/, 1 /*to_library*/, 0 /*is_symbol*/,
-                                 match /*ref_local_id*/, match < shared_lib_size_used /*from_djbz*/,
-                                 1 /*is_refinement*/, filename.data());
+            const std::string filename = get_filename(out_path, "lib", library.count()-1);
+            library.setSaved(library.count()-1);
+            size = zp_position() - record_start;
+            counters.count(Counters::BitmapsAddedToLocalDict, size);
+            count_match(counters, match < shared_lib_size_used, true, size, index_bits);
+
+            if (!visitors.empty()) {
+                visit(JB2Record{t, library.count()-1, img_x, img_y,
+                                mdjvu_bitmap_get_width(library.last()), mdjvu_bitmap_get_height(library.last()),
+                                true /*to_image*/, true /*to_library*/, false /*non_symbol*/,
+                                match, match < shared_lib_size_used /*from_shared*/, size, index_bits,
+                                library.last(), true, filename.data(), -1});
             }
-#endif
         } break;
         case jb2_matched_symbol_with_refinement_add_to_library_only: {
-            size = ftell(zp.file);
-            if (!lib_count)
+            if (!library.count())
             {
+                if (manifest) fclose(manifest);
                 mdjvu_image_destroy(img);
-                free(library);
                 COMPLAIN;
             }
-            jb2.matching_symbol_index.set_interval(0, lib_count - 1);
+            jb2.matching_symbol_index.set_interval(0, library.count() - 1);
+            const double index_start = zp_position();
             int32 match = zp.decode(jb2.matching_symbol_index);
-            *(append_to_list<mdjvu_bitmap_t>(library, lib_count, lib_alloc))
-                    = decode_lib_shape(jb2, img, false, library[match]);
-
-            const std::string filename = get_filename(out_path, "lib", lib_count-1);
-            mdjvu_save_bmp(library[lib_count-1], filename.data(), m_cur_dpi, perr);
-            actions.logAction(t, lib_count-1, false);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::BitmapsAddedToLocalDict, size);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                int32 last_blit = mdjvu_image_get_blit_count(img) - 1;
-                const int x = mdjvu_image_get_blit_x(img, last_blit);
-                int y = mdjvu_image_get_blit_y(img, last_blit);
-                if (page_h) {
-                    y = page_h - y; // return (0,0) to left bottom corner
-                    assert(y >= 0);
-                }
-
-                const int img_w = mdjvu_bitmap_get_width(library[lib_count-1]);
-                const int img_h = mdjvu_bitmap_get_height(library[lib_count-1]);
-                m_sql.add_letter(lib_count-1, x, y,  img_w,  img_h,
-                                 0 /*to_image*/, 1 /*to_library*/, 0 /*is_symbol*/,
-                                 match /*ref_local_id*/, match < shared_lib_size_used /*from_djbz*/,
-                                 1 /*is_refinement*/, filename.data());
+            const double index_bits = zp_position() - index_start;
+            library.add(decode_lib_shape(jb2, img, false, library[match]));
+
+            const std::string filename = get_filename(out_path, "lib", library.count()-1);
+            library.setSaved(library.count()-1);
+            size = zp_position() - record_start;
+            counters.count(Counters::BitmapsAddedToLocalDict, size);
+            count_match(counters, match < shared_lib_size_used, true, size, index_bits);
+            if (!visitors.empty()) { // no blit, the shape goes to library only
+                visit(JB2Record{t, library.count()-1, 0, 0,
+                                mdjvu_bitmap_get_width(library.last()), mdjvu_bitmap_get_height(library.last()),
+                                false /*to_image*/, true /*to_library*/, false /*non_symbol*/,
+                                match, match < shared_lib_size_used /*from_shared*/, size, index_bits,
+                                library.last(), true, filename.data(), -1});
             }
-#endif
         } break;
         case jb2_matched_symbol_with_refinement_add_to_image_only: {
-            size = ftell(zp.file);
-            if (!lib_count)
+            if (!library.count())
             {
+                if (manifest) fclose(manifest);
                 mdjvu_image_destroy(img);
-                free(library);
                 COMPLAIN;
             }
-            jb2.matching_symbol_index.set_interval(0, lib_count - 1);
+            jb2.matching_symbol_index.set_interval(0, library.count() - 1);
+            const double index_start = zp_position();
             int32 match = zp.decode(jb2.matching_symbol_index);
+            const double index_bits = zp_position() - index_start;
             jb2.decode(img, library[match]);
             int32 index = mdjvu_image_get_bitmap_count(img);
             jb2.decode_blit(img, index-1);
 
             const std::string filename = get_filename(out_path, "img", index);
             const mdjvu_bitmap_t bitmap = mdjvu_image_get_bitmap(img, index);
-            mdjvu_save_bmp(bitmap, filename.data(), m_cur_dpi, perr);
             int32 last_blit = mdjvu_image_get_blit_count(img) - 1;
             const int32 x = mdjvu_image_get_blit_x(img, last_blit);
             int32 y = mdjvu_image_get_blit_y(img, last_blit);
@@ -449,35 +538,29 @@ mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const Share
                 assert(y >= 0);
             }
 
-            actions.logAction(t, index, index < shared_lib_size_used, x, y);
-            size = ftell(zp.file) - size;
-            if (index < shared_lib_size_used) {
-                m_counters.count(Counters::SharedDictUsage, size);
-            } else {
-                m_counters.count(Counters::LocalDictUsage), size;
-            }
-            m_counters.count(Counters::UniqElementsOnPage, size);
+            size = zp_position() - record_start;
+            count_match(counters, match < shared_lib_size_used, false, size, index_bits);
+            counters.count(Counters::UniqElementsOnPage, size);
 
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                m_sql.add_letter(-1, x, y,  mdjvu_bitmap_get_width(bitmap),  mdjvu_bitmap_get_height(bitmap),
-                                 1 /*to_image*/, 0 /*to_library*/, 0 /*is_symbol*/,
-                                 match /*ref_local_id*/, match < shared_lib_size_used /*from_djbz*/,
-                                 1 /*is_refinement*/, filename.data());
+            if (!visitors.empty()) {
+                visit(JB2Record{t, -1, x, y, mdjvu_bitmap_get_width(bitmap), mdjvu_bitmap_get_height(bitmap),
+                                true /*to_image*/, false /*to_library*/, false /*non_symbol*/,
+                                match, match < shared_lib_size_used /*from_shared*/, size, index_bits,
+                                bitmap, true, filename.data(), index});
             }
-#endif
 
         } break;
         case jb2_matched_symbol_copy_to_image_without_refinement: {
-            size = ftell(zp.file);
-            if (!lib_count)
+            if (!library.count())
             {
+                if (manifest) fclose(manifest);
                 mdjvu_image_destroy(img);
-                free(library);
                 COMPLAIN;
             }
-            jb2.matching_symbol_index.set_interval(0, lib_count - 1);
+            jb2.matching_symbol_index.set_interval(0, library.count() - 1);
+            const double index_start = zp_position();
             int32 match = zp.decode(jb2.matching_symbol_index);
+            const double index_bits = zp_position() - index_start;
 
             ////////////////////////////////////
             // There was just a single line:
@@ -490,34 +573,36 @@ mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const Share
             int32 ws = mdjvu_bitmap_get_width(shape);
             int32 hs = mdjvu_bitmap_get_height(shape);
             int32 x, y;
-            jb2.decode_character_position(x, y, ws, hs);
+            jb2.decode_position(x, y, ws, hs);
             if (page_h) {
                 y = page_h - y; // return (0,0) to left bottom corner
                 assert(y >= 0);
             }
             mdjvu_image_add_blit(img, x, y, shape);
 
-            const std::string filename = get_filename(out_path, "lib", match);
-            mdjvu_save_bmp(shape, filename.data(), m_cur_dpi, perr);
-            actions.logAction(t, match, match < shared_lib_size_used, x, y);
-            size = ftell(zp.file) - size;
+            // the bitmap is already saved by this page or the dictionary dump,
+            // just refer the existing file
+            std::string filename;
             if (match < shared_lib_size_used) {
-                m_counters.count(Counters::SharedDictUsage, size);
+                filename = get_filename(shared_library->dump_path, "lib", match);
+                if (manifest && !library.isSaved(match)) {
+                    fprintf(manifest, "%u\t%s\n", match, filename.c_str());
+                }
             } else {
-                m_counters.count(Counters::LocalDictUsage, size);
+                filename = get_filename(out_path, "lib", match);
             }
-
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                m_sql.add_letter(-1, x, y,  ws,  hs,
-                                 1 /*to_image*/, 0 /*to_library*/, 0 /*is_symbol*/,
-                                 match /*ref_local_id*/, match < shared_lib_size_used /*from_djbz*/,
-                                 1 /*is_refinement*/, filename.data());
+            library.setSaved(match); // listed in manifest.log once
+            size = zp_position() - record_start;
+            count_match(counters, match < shared_lib_size_used, false, size, index_bits);
+
+            if (!visitors.empty()) {
+                visit(JB2Record{t, -1, x, y, ws, hs,
+                                true /*to_image*/, false /*to_library*/, false /*non_symbol*/,
+                                match, match < shared_lib_size_used /*from_shared*/, size, index_bits,
+                                shape, false, filename.data(), -1});
             }
-#endif
         } break;
         case jb2_non_symbol_data: {
-            size = ftell(zp.file);
             mdjvu_bitmap_t bmp = jb2.decode(img);
             int32 x = zp.decode(jb2.symbol_column_number) - 1;
             int32 y = zp.decode(jb2.symbol_row_number);
@@ -528,247 +613,878 @@ mdjvu_image_t JB2Dumper::loadAndDumpJB2Image(FILE * f, int32 length, const Share
             int32 index = mdjvu_image_get_bitmap_count(img);
             mdjvu_image_add_blit(img, x, y, bmp);
             const std::string filename = get_filename(out_path, "non_symb", index);
-            mdjvu_save_bmp(bmp, filename.data(), m_cur_dpi, perr);
-            actions.logAction(t, index, false, x, y);
-            size = ftell(zp.file) - size;
-            m_counters.count(Counters::UniqElementsOnPage, size);
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                const int img_w = mdjvu_bitmap_get_width(bmp);
-                const int img_h = mdjvu_bitmap_get_height(bmp);
-                m_sql.add_letter(-1, x, y,  img_w,  img_h,
-                                 1 /*to_image*/, 0 /*to_library*/, 1 /*is_symbol*/,
-                                 -1 /*ref_local_id*/, 0 /*from_djbz*/,
-                                 0 /*is_refinement*/, filename.data());
+            size = zp_position() - record_start;
+            counters.count(Counters::UniqElementsOnPage, size);
+            if (!visitors.empty()) {
+                visit(JB2Record{t, -1, x, y, mdjvu_bitmap_get_width(bmp), mdjvu_bitmap_get_height(bmp),
+                                true /*to_image*/, false /*to_library*/, true /*non_symbol*/,
+                                -1 /*match*/, false /*from_shared*/, size, 0,
+                                bmp, true, filename.data(), index});
             }
-#endif
         } break;
 
         case jb2_require_dictionary_or_reset: {
             jb2.reset();
-            actions.logAction(t);
+            visit_plain(t, zp_position() - record_start, 0, 0);
         } break;
 
         case jb2_comment: {
-            actions.logAction(t);
             int32 len = zp.decode(jb2.comment_length);
             while (len--) zp.decode(jb2.comment_octet);
+            visit_plain(t, zp_position() - record_start, 0, 0);
         } break;
 
         case jb2_end_of_data: {
-            if (local_dict) {
-                local_dict->bitmaps = clone_library(library, lib_count);
-                local_dict->count = lib_count;
+            if (local_dict) { // img owns the bitmaps and has to be kept alive with the dictionary
+                local_dict->bitmaps = library.releaseLocal(&local_dict->count);
+                local_dict->image = img;
             }
 
-            m_counters.count(Counters::ElementsOnPage, mdjvu_image_get_blit_count(img));
-            actions.logAction(t);
-            free(library);
+            counters.count(Counters::ElementsOnPage, mdjvu_image_get_blit_count(img));
+            visit_plain(t, zp_position() - record_start, 0, 0);
+            end_form();
+            if (manifest) fclose(manifest);
             return img;
         }
         default:
-            free(library);
+            if (manifest) fclose(manifest);
             mdjvu_image_destroy(img);
             COMPLAIN;
         } // switch
 
-        m_counters.count((Counters::CountersType)t, size);
+        counters.count((Counters::CountersType)t, zp_position() - record_start);
     } // while(1)
 }/*}}}*/
 
 
-#define ID_DJVI           0x444A5649
 #define CHUNK_ID_Sjbz     0x536A627A
 #define CHUNK_ID_Djbz     0x446A627A
 #define CHUNK_ID_INCL     0x494E434C
 #define CHUNK_ID_INFO     0x494E464F
 
-static void skip_whole_chunk_aligned(FILE* f, IFFChunk *chunk, unsigned len) {
-    skip_in_chunk(chunk, len);
-    unsigned aligned_len = (len + 1) & ~1; // should be even (DjVu3Spec.pdf p.9)
-    if (aligned_len > len) {
-        fseek(f, 1, SEEK_CUR);
+mdjvu_image_t JB2Dumper::decodeJB2Image(const DjVuDocument& doc, const ChunkView& chunk, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, DumpContext& ctx)
+{
+    FILE* f = doc.openStream(chunk.offset, chunk.length);
+    if (!f) {
+        return NULL;
     }
+    // saving and logging are timed by their own phases
+    const double nested = ctx.times.sum();
+    Stopwatch timer;
+    mdjvu_image_t res = loadAndDumpJB2Image(f, chunk.length, shared_library, local_dict, ctx);
+    ctx.times.add(PhaseTimes::JB2Decode, timer.elapsed() - (ctx.times.sum() - nested));
+    fclose(f);
+    return res;
 }
 
-int JB2Dumper::dumpDjbz(FILE *f, IFFChunk *form, const char* out_path, SharedDictInfo* local_dict, mdjvu_error_t* p_err)
+bool JB2Dumper::makeDumpPath(DumpContext& ctx)
+{
+    if (m_opts->stats_only) { // nothing is written to entry folder
+        return true;
+    }
+    PhaseTimer timer(&ctx.times, PhaseTimes::MakeDirs);
+    return mkpath(ctx.dump_path) == 0;
+}
+
+int JB2Dumper::dumpDjbz(const DjVuDocument& doc, DumpContext& ctx, SharedDictInfo* local_dict)
 {   // Form marked as DJVI
-#ifdef HAVE_LIBSQLITE3
-    if (_save_to_sql) {
-        m_sql.start_new_djbz();
+    ctx.record.type = 2;
+    ctx.info.type = 2;
+
+    ChunkView dict;
+    if (doc.findChild(ctx.form, CHUNK_ID_Djbz, &dict) && makeDumpPath(ctx)) {
+        if (m_dict_cache.isOpen()) {
+            return dumpCachedDjbz(doc, dict, ctx, local_dict);
+        }
+        if (decodeJB2Image(doc, dict, NULL, local_dict, ctx)) { // owned by local_dict now
+            return 1;
+        }
     }
-#endif
 
-    IFFChunk dict;
-    get_child_chunk(f, &dict, form);
-    if (find_sibling_chunk(f, &dict, CHUNK_ID_Djbz)) {
-        if (mkpath(out_path) == 0) {
-            mdjvu_image_t res = loadAndDumpJB2Image(f, dict.length, NULL, local_dict, out_path, p_err);
-            if (res) {
-                mdjvu_image_destroy(res);
-                skip_whole_chunk_aligned(f, dict.parent, dict.length);
-                return 1;
+    return 0;
+}
+
+int JB2Dumper::dumpCachedDjbz(const DjVuDocument& doc, const ChunkView& dict, DumpContext& ctx, SharedDictInfo* local_dict)
+{
+    DictTrace trace;
+    mdjvu_image_t image = NULL;
+    std::vector<mdjvu_bitmap_t> bitmaps;
+    bool hit;
+    uint64_t key;
+    {
+        PhaseTimer timer(&ctx.times, PhaseTimes::DictCache);
+        key = DictCache::key(dict.data, dict.length);
+        hit = m_dict_cache.load(key, dict.data, dict.length, &trace, &image, &bitmaps);
+    }
+    if (hit) {
+        ctx.counters.count(Counters::DictCacheHits);
+        replayDict(ctx, trace, image, bitmaps, local_dict);
+        return 1;
+    }
+
+    ctx.counters.count(Counters::DictCacheMisses);
+    ctx.trace = &trace;
+    const bool decoded = decodeJB2Image(doc, dict, NULL, local_dict, ctx) != NULL;
+    ctx.trace = NULL;
+    if (decoded && trace.cacheable()) {
+        PhaseTimer timer(&ctx.times, PhaseTimes::DictCache);
+        if (!m_dict_cache.store(key, dict.data, dict.length, trace, local_dict->bitmaps, local_dict->count) && m_opts->verbose) {
+            fprintf(stderr, "Can't store dictionary %s in %s\n", ctx.entry->id_str, m_opts->dict_cache);
+        }
+    }
+    return decoded;
+}
+
+// Does what loadAndDumpJB2Image() does for the records of a dictionary
+// without decoding: stats, counters and the events that make the outputs.
+void JB2Dumper::replayDict(DumpContext& ctx, const DictTrace& trace, mdjvu_image_t image,
+                           const std::vector<mdjvu_bitmap_t>& bitmaps, SharedDictInfo* local_dict)
+{
+    const char* out_path = ctx.dump_path.c_str();
+    Counters& counters = ctx.counters;
+
+    LogFile log(&counters);
+    log.open(ctx.stats_file.data());
+    log.log("Using local dictionary\n");
+
+    FormOutputs outputs(ctx);
+    attachOutputs(ctx, outputs);
+    const std::vector<JB2Visitor*>& visitors = outputs.visitors;
+    for (size_t v = 0; v < visitors.size(); v++) {
+        visitors[v]->beginForm(ctx.info);
+    }
+
+    const std::vector<JB2Record>& records = trace.records();
+    size_t next = 0; // library bitmap
+    double bits = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        JB2Record r = records[i];
+        std::string filename;
+        bits += r.bits;
+        switch (r.type) {
+        case jb2_start_of_image:
+            counters.count((Counters::CountersType)r.type);
+            break;
+        case jb2_new_symbol_add_to_library_only:
+        case jb2_matched_symbol_with_refinement_add_to_library_only:
+            r.bitmap = bitmaps[next++];
+            filename = get_filename(out_path, "lib", r.local_id);
+            r.filename = filename.data();
+            counters.count(Counters::BitmapsAddedToLocalDict, r.bits);
+            if (r.match >= 0) {
+                count_match(counters, false, true, r.bits, r.index_bits);
             }
+            counters.count((Counters::CountersType)r.type, r.bits);
+            break;
+        case jb2_end_of_data:
+            counters.count(Counters::ElementsOnPage, 0);
+            break;
+        default: // reset, comment
+            counters.count((Counters::CountersType)r.type, r.bits);
+            break;
+        }
+        for (size_t v = 0; v < visitors.size(); v++) {
+            visitors[v]->record(ctx.info, r);
         }
     }
-#ifdef HAVE_LIBSQLITE3
-    if (_save_to_sql) {
-        m_sql.endof_djbz();
+    for (size_t v = 0; v < visitors.size(); v++) {
+        visitors[v]->endForm(ctx.info, bits);
     }
-#endif
 
-    return 0;
+    // image owns the bitmaps, as after decoding
+    local_dict->count = bitmaps.size();
+    local_dict->bitmaps = (mdjvu_bitmap_t*) malloc((bitmaps.empty() ? 1 : bitmaps.size()) * sizeof(mdjvu_bitmap_t));
+    if (!bitmaps.empty()) {
+        memcpy(local_dict->bitmaps, bitmaps.data(), bitmaps.size() * sizeof(mdjvu_bitmap_t));
+    }
+    local_dict->image = image;
 }
 
-int JB2Dumper::dumpSjbz(FILE *f, IFFChunk *form, const char* out_path, mdjvu_error_t* p_err, const struct Options* opts)
+int JB2Dumper::dumpSjbz(const DjVuDocument& doc, DumpContext& ctx)
 {   // Form marked as DJVU
-    assert(form);
-
-    SharedDictInfo* shared_dict_for_page = NULL;
-    m_cur_dpi = 600;
+    const SharedDictInfo* shared_dict_for_page = NULL;
+    if (ctx.dict >= 0 && m_shared_dicts[ctx.dict].bitmaps) {
+        shared_dict_for_page = &m_shared_dicts[ctx.dict];
+        ctx.info.dictionary = shared_dict_for_page->id;
+    }
+    ctx.info.type = 1;
+    ctx.dpi = ctx.info.dpi = 600;
 
-    IFFChunk chunk;
-    while (form->skipped < form->length) {
-        get_child_chunk(f, &chunk, form);
+    ChunkView chunk;
+    bool has_chunk = doc.firstChild(ctx.form, &chunk);
+    for (; has_chunk; has_chunk = doc.nextSibling(ctx.form, &chunk)) {
 
         switch (chunk.id) {
         case CHUNK_ID_INFO: {
-            unsigned char * info =  (unsigned char *) calloc(chunk.length, sizeof(char));
-            const int32 readen = fread(info, 1, chunk.length, f);
-            assert(readen == chunk.length);
-            assert(chunk.length >= 10);
-            m_cur_dpi = info[6] | info[7] << 8;
+            const unsigned char * info = chunk.data;
+            if (chunk.length < 10) {
+                break;
+            }
+            ctx.dpi = info[6] | info[7] << 8;
 
-            if (opts->verbose) {
+            if (m_opts->verbose) {
                 fprintf(stdout, "Reading page Info: w:%u h:%u ver:%u dpi:%u\n",
-                        info[1]|info[0]<<8, info[3]|info[2]<<8, (info[5]<<8)+info[4], m_cur_dpi);
+                        info[1]|info[0]<<8, info[3]|info[2]<<8, (info[5]<<8)+info[4], ctx.dpi);
             }
-#ifdef HAVE_LIBSQLITE3
-            if (_save_to_sql) {
-                m_sql.start_new_sjbz(info[1]|info[0]<<8, info[3]|info[2]<<8, (info[5]<<8)+info[4], m_cur_dpi);
-            }
-#endif
-            free(info);
-        }
-            break;
-        case CHUNK_ID_INCL: {
-            shared_dict_for_page = NULL;
-            void * id = calloc(chunk.length, sizeof(unsigned char));
-            int32 readed = fread(id, 1, chunk.length, f);
-            assert(readed = chunk.length);
-            for (int i = 0; i < m_shared_dict_cnt; i++) {
-                if (memcmp(m_shared_dicts[i].id, id, chunk.length) == 0) {
-                    shared_dict_for_page = &m_shared_dicts[i];
-                    break;
-                }
-            }
-            free(id);
+            ctx.record.type = 1;
+            ctx.record.w = info[1]|info[0]<<8;
+            ctx.record.h = info[3]|info[2]<<8;
+            ctx.record.version = (info[5]<<8)+info[4];
+            ctx.record.dpi = ctx.dpi;
+            ctx.info.width = ctx.record.w;
+            ctx.info.height = ctx.record.h;
+            ctx.info.version = ctx.record.version;
+            ctx.info.dpi = ctx.dpi;
         }
             break;
         case CHUNK_ID_Sjbz: {
-            if (mkpath(out_path) == 0) {
-                mdjvu_image_t res = loadAndDumpJB2Image(f, chunk.length, shared_dict_for_page, NULL, out_path, p_err);
-                if (!res) { return 0; }
-                mdjvu_bitmap_t bitmap = mdjvu_render(res);
-                mdjvu_save_bmp(bitmap, get_filename(out_path, "page").data(), m_cur_dpi, p_err);
-                mdjvu_bitmap_destroy(bitmap);
-                mdjvu_image_destroy(res);
-                skip_whole_chunk_aligned(f, form, chunk.length+8);
-                return 1;
+            if (!makeDumpPath(ctx)) {
+                return 0;
             }
-            return 0;
+            mdjvu_image_t res = decodeJB2Image(doc, chunk, shared_dict_for_page, NULL, ctx);
+            if (!res) { return 0; }
+            if (!m_opts->stats_only && m_opts->output_format != OutputSQL) {
+                // rendering and writing of BMP go together by bands
+                PhaseTimer timer(&ctx.times, PhaseTimes::PageRender);
+                m_writer->savePage(res, SymbolKey{ctx.entry_no, SymbolPage, 0}, get_filename(ctx.dump_path, "page"), ctx.dpi);
+                if (m_track_files) {
+                    ctx.files.push_back(get_filename(ctx.dump_path, "page"));
+                }
+            }
+            mdjvu_image_destroy(res);
+            return 1;
         }
             break;
-        default:
-            fseek(f, chunk.length, SEEK_CUR);
+        default: // INCL is resolved before dumping
             break;
         }
-        skip_whole_chunk_aligned(f, form, chunk.length+8);
     }
     return 0;
 }
 
-int JB2Dumper::dumpMultiPage(FILE * f, const DIRM_Entry* entries, int size, const char* out_path, mdjvu_error_t *p_err, const Options *opts)
+void JB2Dumper::dumpEntry(const DjVuDocument& doc, DumpContext& ctx)
 {
-    if (mkpath(out_path)) {
-        return 0;
+    if (ctx.skip) {
+        return;
+    }
+    if (ctx.form_type == ID_DJVI) {
+        SharedDictInfo res;
+        if (dumpDjbz(doc, ctx, &res)) {
+            res.id = ctx.entry->id_str;
+            res.dump_path = ctx.dump_path.c_str();
+            storeDict(ctx.index, res);
+        }
+    } else if (ctx.form_type == ID_DJVU) {
+        dumpSjbz(doc, ctx);
+        if (ctx.dict >= 0) {
+            releaseDict(ctx.dict);
+        }
     }
+}
 
-    LogFile totalLog(&m_counters, true);
-    totalLog.open(get_statsname(out_path, "stats.log").data());
-    m_counters.clear();
+static size_t dict_memory(const SharedDictInfo& dict)
+{
+    size_t res = 0;
+    for (int32 i = 0; i < dict.count; i++) {
+        if (dict.bitmaps[i]) { // rows of packed bits and row pointers
+            res += mdjvu_bitmap_get_height(dict.bitmaps[i]) *
+                    (size_t) (mdjvu_bitmap_get_packed_row_size(dict.bitmaps[i]) + sizeof(void*));
+        }
+    }
+    return res + dict.count * sizeof(mdjvu_bitmap_t);
+}
+
+bool JB2Dumper::admitDict(int idx)
+{
+    std::lock_guard<std::mutex> lock(m_dict_mutex);
+    // size of a dictionary isn't known before decoding, so the largest one
+    // (or the whole budget before the first) is expected. Without other
+    // dictionaries one is decoded anyway.
+    const size_t expected = m_dict_memory_max ? m_dict_memory_max : m_dict_budget;
+    const bool idle = !m_dict_memory && !m_dicts_decoding;
+    if (m_dict_budget && !idle &&
+            m_dict_memory + (m_dicts_decoding + 1) * expected > m_dict_budget) {
+        m_deferred_dicts.push_back(idx);
+        return false;
+    }
+    m_dicts_decoding++;
+    return true;
+}
+
+void JB2Dumper::storeDict(int idx, const SharedDictInfo& dict)
+{
+    std::lock_guard<std::mutex> lock(m_dict_mutex);
+    m_shared_dicts[idx] = dict;
+    m_shared_dicts[idx].memory = dict_memory(dict);
+    m_dict_memory += m_shared_dicts[idx].memory;
+    m_dict_memory_peak = std::max(m_dict_memory_peak, m_dict_memory);
+    m_dict_memory_max = std::max(m_dict_memory_max, m_shared_dicts[idx].memory);
+    if (!m_dict_users[idx]) { // no page INCLudes it
+        m_dict_memory -= m_shared_dicts[idx].memory;
+        freeDict(m_shared_dicts[idx]);
+    }
+}
+
+void JB2Dumper::releaseDict(int idx)
+{
+    std::lock_guard<std::mutex> lock(m_dict_mutex);
+    if (--m_dict_users[idx] == 0) {
+        m_dict_memory -= m_shared_dicts[idx].memory;
+        freeDict(m_shared_dicts[idx]);
+    }
+}
 
+std::vector<int> JB2Dumper::resumeDicts(bool decoded)
+{
+    std::vector<int> res;
+    std::lock_guard<std::mutex> lock(m_dict_mutex);
+    if (decoded) {
+        m_dicts_decoding--;
+    }
+    // admitDict() checks the budget again, in DIRM order
+    res.swap(m_deferred_dicts);
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+void JB2Dumper::commitEntry(DumpContext& ctx, mdjvu_error_t* p_err)
+{
+    m_counters.merge(ctx.counters);
+    if (ctx.err && p_err) {
+        *p_err = ctx.err;
+    }
 #ifdef HAVE_LIBSQLITE3
-    _save_to_sql = opts->save_to_sql;
-    if (_save_to_sql) {
-        const std::string sql_path = get_sqlname(out_path);
-        if ( !m_sql.init(sql_path.c_str()) ) {
-            exit(3);
-        };
+    if (m_save_to_sql && !ctx.skip && !ctx.kept_rows) {
+        PhaseTimer timer(&ctx.times, PhaseTimes::SQLInsert);
+        m_sql.add_form(ctx.entry_no, ctx.entry->id_str, ctx.dump_path.data(), ctx.record);
     }
 #endif
+    if (m_columns.isOpen()) {
+        PhaseTimer timer(&ctx.times, PhaseTimes::ColumnsWrite);
+        m_columns.addForm(ctx.entry_no, ctx.entry->id_str, ctx.dump_path.data(), ctx.record);
+    }
+    ctx.record.clear();
+    if (ctx.skip) { // perf.json of the previous run is kept
+        return;
+    }
+    m_times.merge(ctx.times);
+    ctx.times.writeJson(ctx.perf_file, "  \"entry\": " + json_string(ctx.entry->id_str) +
+                        ",\n  \"position\": " + std::to_string(ctx.entry_no));
+    if (m_manifest) {
+        checkpointEntry(ctx);
+    }
+}
 
+void JB2Dumper::markDone(int idx)
+{
+    // notify under the lock: once the last entry is done the dumper may be
+    // destroyed by the committing thread
+    std::lock_guard<std::mutex> lock(m_done_mutex);
+    m_done[idx] = 1;
+    m_done_cv.notify_all();
+}
 
-    m_cur_entry_no = 0;
-    for (m_cur_entry_no = 0; m_cur_entry_no < size; m_cur_entry_no++)
-    {
-        const DIRM_Entry& entry = entries[m_cur_entry_no];
+void JB2Dumper::waitDone(int idx)
+{
+    std::unique_lock<std::mutex> lock(m_done_mutex);
+    m_done_cv.wait(lock, [this, idx] { return m_done[idx] != 0; });
+}
 
-        if (entry.type == Thumbnails) {
+void JB2Dumper::runEntry(WorkerPool& pool, const DjVuDocument& doc, std::vector<DumpContext>& ctxs,
+                         const std::vector< std::vector<int> >& dependents, int idx)
+{
+    const bool dict = ctxs[idx].form_type == ID_DJVI && !ctxs[idx].skip;
+    if (dict && !admitDict(idx)) {
+        return; // submitted again when memory of other dictionaries is freed
+    }
+    dumpEntry(doc, ctxs[idx]);
+    // pages that INCLude this dictionary may go now
+    for (size_t i = 0; i < dependents[idx].size(); i++) {
+        const int dep = dependents[idx][i];
+        pool.submit([this, &pool, &doc, &ctxs, &dependents, dep] {
+            runEntry(pool, doc, ctxs, dependents, dep);
+        });
+    }
+    const std::vector<int> resumed = resumeDicts(dict);
+    for (size_t i = 0; i < resumed.size(); i++) {
+        const int next = resumed[i];
+        pool.submit([this, &pool, &doc, &ctxs, &dependents, next] {
+            runEntry(pool, doc, ctxs, dependents, next);
+        });
+    }
+    markDone(idx);
+}
+
+// files of manifest are relative to the output folder
+static std::string relative_name(const std::string& root, const std::string& name)
+{
+    return name.compare(0, root.length(), root) == 0 ? name.substr(root.length()) : name;
+}
+
+static void remove_files(const std::string& root, const std::vector<std::string>& files,
+                         const std::set<std::string>& keep = std::set<std::string>())
+{
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!keep.count(files[i])) {
+            remove((root + files[i]).c_str());
+        }
+    }
+}
+
+void JB2Dumper::planIncremental(const DjVuDocument& doc, std::vector<DumpContext>& ctxs, const char* out_path,
+                                const IncrementalManifest& previous, IncrementalManifest& kept)
+{
+    std::vector<const IncrementalManifest::Entry*> found(ctxs.size());
+    std::set<std::string> names;
+    for (size_t i = 0; i < ctxs.size(); i++) {
+        ctxs[i].hash = IncrementalManifest::formHash(doc, ctxs[i].form);
+        const std::string name = get_subdir_name(ctxs[i].entry->id_str, ctxs[i].entry_no);
+        found[i] = previous.find(name);
+        names.insert(name);
+    }
+
+    // a page is kept if neither it nor its dictionary changed, a dictionary
+    // is kept if all its pages are
+    std::vector<char> dict_needed(ctxs.size(), 0);
+    for (size_t i = 0; i < ctxs.size(); i++) {
+        DumpContext& ctx = ctxs[i];
+        if (ctx.form_type == ID_DJVI) {
+            continue;
+        }
+        ctx.dict_hash = ctx.dict >= 0 ? ctxs[ctx.dict].hash : 0;
+        // the dictionary itself may be missing after an interrupted run
+        const bool dict_kept = ctx.dict < 0 || (found[ctx.dict] && found[ctx.dict]->hash == ctx.dict_hash);
+        ctx.skip = dict_kept && found[i] && found[i]->hash == ctx.hash && found[i]->dict_hash == ctx.dict_hash;
+        if (!ctx.skip && ctx.dict >= 0) {
+            dict_needed[ctx.dict] = 1;
+        }
+    }
+    int skipped = 0;
+    for (size_t i = 0; i < ctxs.size(); i++) {
+        DumpContext& ctx = ctxs[i];
+        if (ctx.form_type == ID_DJVI) {
+            const bool same = found[i] && found[i]->hash == ctx.hash;
+            ctx.skip = same && !dict_needed[i];
+            ctx.kept_rows = same && dict_needed[i];
+        }
+        if (!ctx.skip) {
             continue;
         }
+        for (int c = 0; c < Counters::LastCounter; c++) {
+            const Counters::CountersType cntr = (Counters::CountersType) c;
+            ctx.counters.count(cntr, found[i]->counters.pageSize(cntr), found[i]->counters.page(cntr));
+        }
+        kept.add(*found[i]);
+        skipped++;
+    }
 
-        if (fseek(f, entry.offset, SEEK_SET)) {
-            fprintf(stderr, "ERROR: can't fseek to %u", entry.offset);
-            if (p_err) *p_err = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+    // entries that are gone from the document
+    const std::string root = get_statsname(out_path, "");
+    for (std::map<std::string, IncrementalManifest::Entry>::const_iterator it = previous.entries().begin();
+         it != previous.entries().end(); ++it) {
+        if (!names.count(it->first)) {
+            remove_files(root, it->second.files);
+            remove((root + it->first).c_str()); // the folder, if empty
+        }
+    }
+    if (m_opts->verbose) {
+        fprintf(stdout, "Incremental dump: %d of %d entries are unchanged\n", skipped, (int) ctxs.size());
+    }
+}
+
+void JB2Dumper::checkpointEntry(DumpContext& ctx)
+{
+    // the record must not get ahead of the rows and bitmaps of the entry
+#ifdef HAVE_LIBSQLITE3
+    if (m_save_to_sql) {
+        PhaseTimer timer(&m_times, PhaseTimes::SQLInsert);
+        m_sql.checkpoint();
+    }
+#endif
+    m_writer->waitForm(ctx.entry_no);
+
+    const std::string& root = m_manifest_root;
+    IncrementalManifest::Entry entry;
+    entry.name = get_subdir_name(ctx.entry->id_str, ctx.entry_no);
+    entry.hash = ctx.hash;
+    entry.dict_hash = ctx.dict_hash;
+    entry.counters = ctx.counters;
+
+    std::set<std::string> files;
+    for (size_t j = 0; j < ctx.files.size(); j++) {
+        files.insert(relative_name(root, ctx.files[j]));
+    }
+    files.insert(relative_name(root, ctx.stats_file));
+    if (!ctx.perf_file.empty()) {
+        files.insert(relative_name(root, ctx.perf_file));
+    }
+    if (!m_opts->stats_only) {
+        files.insert(relative_name(root, get_statsname(ctx.dump_path, "actions.log")));
+        if (m_opts->write_manifest && ctx.form_type == ID_DJVU) {
+            files.insert(relative_name(root, get_statsname(ctx.dump_path, "manifest.log")));
+        }
+    }
+    entry.files.assign(files.begin(), files.end());
+    ctx.files.clear();
+
+    // files of the previous run the entry doesn't have anymore
+    const IncrementalManifest::Entry* old = m_previous->find(entry.name);
+    if (old) {
+        remove_files(root, old->files, files);
+    }
+    if (!ctx.err && !m_manifest->append(entry)) { // with an error it's dumped again by the next run
+        fprintf(stderr, "Warning: can't write a checkpoint of %s\n", entry.name.c_str());
+    }
+}
+
+// -pages, -entries: marks selected entries and dictionaries INCLuded by
+// selected pages. Only forms of selected pages are read, so the time
+// doesn't grow with the document.
+static int select_entries(const DjVuDocument& doc, const DIRM_Entry* entries, int size, const Options* opts,
+                          std::vector<char>& selected)
+{
+    RangeSelection pages, positions;
+    if (opts->pages) pages.parse(opts->pages);
+    if (opts->entries) positions.parse(opts->entries);
+
+    selected.assign(size, 0);
+    std::map<std::string, int> dicts; // by id, filled on the first INCL
+    int page_no = 0;
+    int res = 0;
+    for (int entry_no = 0; entry_no < size; entry_no++) {
+        const DIRM_Entry& entry = entries[entry_no];
+        if (entry.type == Page) {
+            page_no++;
+        }
+        if (!(entry.type == Page && pages.contains(page_no)) && !positions.contains(entry_no)) {
+            continue;
+        }
+        if (!selected[entry_no]) {
+            selected[entry_no] = 1;
+            res++;
+        }
+
+        ChunkView FORM;
+        if (!doc.readChunk(entry.offset, &FORM) || FORM.id != CHUNK_ID_FORM || FORM.length < 4 ||
+                read_uint32_most_significant_byte_first_buf(FORM.data) != ID_DJVU) {
+            continue; // reported by dumpMultiPage()
+        }
+        ChunkView chunk;
+        bool has_chunk = doc.firstChild(FORM, &chunk);
+        for (; has_chunk && chunk.id != CHUNK_ID_Sjbz; has_chunk = doc.nextSibling(FORM, &chunk)) {
+            if (chunk.id != CHUNK_ID_INCL) {
+                continue;
+            }
+            if (dicts.empty()) {
+                for (int i = 0; i < size; i++) {
+                    if (entries[i].type == SharedFile) {
+                        dicts.insert(std::make_pair(std::string(entries[i].id_str), i));
+                    }
+                }
+            }
+            std::map<std::string, int>::const_iterator it =
+                    dicts.find(std::string((const char*) chunk.data, chunk.length));
+            if (it != dicts.end() && !selected[it->second]) {
+                selected[it->second] = 1;
+                res++;
+            }
+        }
+    }
+    return res;
+}
+
+int JB2Dumper::dumpMultiPage(const DjVuDocument& doc, const DIRM_Entry* entries, int size, const char* out_path, mdjvu_error_t *p_err, const Options *opts,
+                             WorkerPool* shared_pool)
+{
+    Stopwatch wall;
+    // without out_path (events for a visitor only) no file is written
+    const bool no_files = !out_path;
+    if (no_files) {
+        out_path = ""; // path helpers give empty names for it
+    } else {
+        PhaseTimer timer(&m_times, PhaseTimes::MakeDirs);
+        if (mkpath(out_path)) {
             return 0;
         }
+    }
+    m_opts = opts;
+    m_dict_cache = DictCache();
+    if (opts->dict_cache && !m_dict_cache.open(opts->dict_cache, p_err)) {
+        return 0;
+    }
+
+    std::vector<char> selected;
+    if (opts->pages || opts->entries) {
+        const int count = select_entries(doc, entries, size, opts, selected);
+        if (!count) {
+            fprintf(stderr, "Warning: no entries are selected by -pages and -entries\n");
+        } else if (opts->verbose) {
+            fprintf(stdout, "Selected %d of %d entries (with dictionaries)\n", count, size);
+        }
+    }
+
+    // Locate forms and resolve dictionaries INCLuded by pages
+    std::vector<DumpContext> ctxs;
+    ctxs.reserve(size);
+    for (int entry_no = 0; entry_no < size; entry_no++)
+    {
+        const DIRM_Entry& entry = entries[entry_no];
+
+        if (entry.type == Thumbnails || (!selected.empty() && !selected[entry_no])) {
+            continue;
+        }
 
-        IFFChunk FORM;
-        get_child_chunk(f, &FORM, NULL); // no parent chunk as we already know all offsets and can fseek
-        if (!find_sibling_chunk(f, &FORM, CHUNK_ID_FORM))
+        ChunkView FORM;
+        if (!doc.readChunk(entry.offset, &FORM) || FORM.id != CHUNK_ID_FORM || FORM.length < 4)
         {
-            fprintf(stderr, "No FORM tag found.\n");
+            fprintf(stderr, "No FORM tag found at %u.\n", entry.offset);
             if (p_err) *p_err = mdjvu_get_error(mdjvu_error_corrupted_djvu);
             return 0;
         }
 
-        uint32 id = read_uint32_most_significant_byte_first(f);
-        skip_in_chunk(&FORM, 4);
+        DumpContext ctx;
+        ctx.index = ctxs.size();
+        ctx.entry_no = entry_no;
+        ctx.entry = &entry;
+        ctx.form = FORM;
+        ctx.form_type = read_uint32_most_significant_byte_first_buf(FORM.data);
+        ctx.dict = -1;
+        // without files dump_path, stats_file, perf_file and names of bitmaps stay empty
+        if (!no_files) {
+            ctx.dump_path = get_subdir(out_path, entry.id_str, entry_no);
+            // without subfolders stats of entries go to the output folder
+            ctx.stats_file = opts->stats_only ?
+                        get_statsname(out_path, get_subdir_name(entry.id_str, entry_no) + ".stats.log") :
+                        get_statsname(ctx.dump_path, "stats.log");
+            // with -stats-only timings go to the totals only
+            if (!opts->stats_only) {
+                ctx.perf_file = get_statsname(ctx.dump_path, "perf.json");
+            }
+        }
+        ctx.dpi = 600;
+        ctx.err = NULL;
+        ctx.record.store_bitmaps = opts->output_format == OutputSQL && !opts->stats_only;
+        ctx.info = JB2Form{entry_no, entry.id_str, 0, 0, 0, 0, 0, NULL};
+        ctx.trace = NULL;
+        ctx.skip = false;
+        ctx.kept_rows = false;
+        ctx.hash = 0;
+        ctx.dict_hash = 0;
+
+        if (ctx.form_type == ID_DJVU) {
+            ChunkView chunk;
+            bool has_chunk = doc.firstChild(FORM, &chunk);
+            for (; has_chunk && chunk.id != CHUNK_ID_Sjbz; has_chunk = doc.nextSibling(FORM, &chunk)) {
+                if (chunk.id != CHUNK_ID_INCL) {
+                    continue;
+                }
+                ctx.dict = -1;
+                for (size_t i = 0; i < ctxs.size(); i++) {
+                    const char* id = ctxs[i].entry->id_str;
+                    if (ctxs[i].form_type == ID_DJVI && strlen(id) == chunk.length &&
+                            memcmp(id, chunk.data, chunk.length) == 0) {
+                        ctx.dict = i;
+                        break;
+                    }
+                }
+            }
+        }
+        ctxs.push_back(ctx);
+    }
 
-        const std::string dump_path = get_subdir(out_path, entry.id_str, m_cur_entry_no);
-#ifdef HAVE_LIBSQLITE3
-        if (_save_to_sql) {
-            m_sql.start_new_form(m_cur_entry_no, entry.id_str, dump_path.data());
+    // -incremental, -resume: entries unchanged since the previous (maybe
+    // interrupted) run are skipped
+    const std::string manifest_path = get_statsname(out_path, "incremental.manifest");
+    IncrementalManifest previous, manifest;
+    const bool incremental = opts->incremental && !no_files && IncrementalManifest::supports(opts);
+    if (opts->incremental && !incremental && !no_files) {
+        fprintf(stderr, "Warning: -incremental doesn't work with -columns, -format pack, -pages and -entries, all entries are dumped\n");
+    }
+    m_track_files = incremental;
+    m_manifest = NULL;
+    m_previous = NULL;
+    if (incremental) {
+        previous.load(manifest_path, opts);
+        planIncremental(doc, ctxs, out_path, previous, manifest);
+        // entries being dumped again are appended as they are committed
+        if (!manifest.begin(manifest_path, opts)) {
+            fprintf(stderr, "Can't write %s\n", manifest_path.c_str());
+        }
+        m_manifest = &manifest;
+        m_previous = &previous;
+        m_manifest_root = get_statsname(out_path, "");
+    }
+
+    close();
+    m_shared_dict_cnt = ctxs.size();
+    m_shared_dicts = (SharedDictInfo*) calloc(m_shared_dict_cnt ? m_shared_dict_cnt : 1, sizeof(SharedDictInfo));
+    m_dict_users.assign(ctxs.size(), 0);
+    for (size_t i = 0; i < ctxs.size(); i++) {
+        if (ctxs[i].dict >= 0 && !ctxs[i].skip) {
+            m_dict_users[ctxs[i].dict]++;
         }
+    }
+    m_deferred_dicts.clear();
+    m_dict_memory_peak = m_dict_memory_max = 0;
+    m_dicts_decoding = 0;
+    m_dict_budget = 0;
+
+    LogFile totalLog(&m_counters, true);
+    if (!no_files) {
+        totalLog.open(get_statsname(out_path, "stats.log").data());
+    }
+    m_counters.clear();
+
+    m_collect_records = opts->save_to_sql || opts->write_columns;
+    if (opts->write_columns) {
+        const std::string columns_path = get_statsname(out_path, "columns.djdcol");
+        if (!m_columns.open(columns_path, p_err)) {
+            fprintf(stderr, "Can't create %s\n", columns_path.c_str());
+            return 0;
+        }
+    }
+#ifdef HAVE_LIBSQLITE3
+    m_save_to_sql = opts->save_to_sql;
+    if (m_save_to_sql) {
+        const std::string sql_path = get_sqlname(out_path);
+        if (incremental) {
+            // rows of kept entries stay, the rest is deleted and inserted again
+            std::set<int> kept;
+            for (size_t i = 0; i < ctxs.size(); i++) {
+                if (ctxs[i].skip || ctxs[i].kept_rows) {
+                    kept.insert(ctxs[i].entry_no);
+                }
+            }
+            if (!m_sql.resume(sql_path.c_str(), opts->sql_cache_mb, kept)) {
+                exit(3);
+            }
+        } else if ( !m_sql.init(sql_path.c_str(), opts->sql_direct, opts->sql_cache_mb) ) {
+            exit(3);
+        };
+    }
 #endif
 
-        if (id == ID_DJVI) {
-            SharedDictInfo res;
+    BMPStore bmp_store;
+    PackStore pack_store;
+    BitmapStore* store = &bmp_store;
+    if (opts->stats_only || opts->output_format == OutputSQL) {
+        store = NULL; // bitmaps go to SQL records
+    } else if (opts->output_format == OutputPack) {
+        if (!pack_store.open(get_statsname(out_path, "symbols.pack"), p_err)) {
+            fprintf(stderr, "Can't create %s\n", get_statsname(out_path, "symbols.pack").c_str());
+            return 0;
+        }
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            pack_store.registerForm(ctxs[i].entry_no, get_subdir_name(ctxs[i].entry->id_str, ctxs[i].entry_no));
+        }
+        store = &pack_store;
+    }
 
-            if (dumpDjbz(f, &FORM, dump_path.data(), &res, p_err)) {
-                SharedDictInfo* dict = append_to_list<SharedDictInfo>(m_shared_dicts, m_shared_dict_cnt, m_dict_buf_allocated);
-                *dict = res;
-                dict->id = entry.id_str;
-            } else {
-              //  return 0;
+    BitmapWriter writer(store, opts->io_threads);
+    m_writer = &writer;
+
+    const int jobs = opts->jobs > 0 ? opts->jobs : WorkerPool::hardwareThreads();
+    if (!shared_pool && (jobs == 1 || ctxs.size() < 2)) {
+        // entries go in DIRM order, a dictionary can't wait for memory
+        // here and is just freed after its last page
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            dumpEntry(doc, ctxs[i]);
+            commitEntry(ctxs[i], p_err);
+        }
+    } else {
+        m_dict_budget = (size_t) opts->max_dict_memory_mb << 20;
+        // Dictionaries and pages without dictionary go to the pool at once,
+        // pages go there as soon as their dictionary is decoded.
+        std::vector< std::vector<int> > dependents(ctxs.size());
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            if (ctxs[i].dict >= 0) {
+                dependents[ctxs[i].dict].push_back(i);
             }
-        } else if (id == ID_DJVU) {
-            dumpSjbz(f, &FORM, dump_path.data(), p_err, opts);
         }
-#ifdef HAVE_LIBSQLITE3
-        if (_save_to_sql) {
-            m_sql.endof_form();
+        m_done.assign(ctxs.size(), 0);
+
+        std::unique_ptr<WorkerPool> own_pool;
+        if (!shared_pool) {
+            own_pool.reset(new WorkerPool(jobs));
+        }
+        WorkerPool& pool = shared_pool ? *shared_pool : *own_pool;
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            if (ctxs[i].dict < 0) {
+                const int idx = i;
+                pool.submit([this, &pool, &doc, &ctxs, &dependents, idx] {
+                    runEntry(pool, doc, ctxs, dependents, idx);
+                });
+            }
+        }
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            waitDone(i);
+            commitEntry(ctxs[i], p_err);
+        }
+        // a shared pool runs pages of other documents, all entries of
+        // this one are done already
+        if (own_pool) {
+            own_pool->wait();
         }
-#endif
+    }
+
+    std::string failed_file;
+    mdjvu_error_t write_err = NULL;
+    const int write_errors = writer.flush(&write_err, &failed_file);
+    const double store_time = writer.storeTime();
+    m_writer = NULL;
+    if (write_errors) {
+        fprintf(stderr, "ERROR: %d bitmaps weren't saved, first failed: %s (%s)\n",
+                write_errors, failed_file.c_str(), mdjvu_get_error_message(write_err));
+        if (p_err) *p_err = write_err;
+    }
+    if (incremental) {
+        // a failed write isn't known per entry, so all of this run are dumped again
+        for (size_t i = 0; write_errors && i < ctxs.size(); i++) {
+            if (!ctxs[i].skip) {
+                manifest.erase(get_subdir_name(ctxs[i].entry->id_str, ctxs[i].entry_no));
+            }
+        }
+        if (!manifest.save(manifest_path, opts)) {
+            fprintf(stderr, "Can't write %s\n", manifest_path.c_str());
+        }
+        m_manifest = NULL;
+        m_previous = NULL;
     }
 
     totalLog.close();
 #ifdef HAVE_LIBSQLITE3
-        if (_save_to_sql) {
+        if (m_save_to_sql) {
+            PhaseTimer timer(&m_times, PhaseTimes::SQLInsert);
             m_sql.save_on_disk();
         }
 #endif
+    if (m_columns.isOpen()) {
+        PhaseTimer timer(&m_times, PhaseTimes::ColumnsWrite);
+        mdjvu_error_t columns_err = NULL;
+        if (!m_columns.finish(&columns_err)) {
+            fprintf(stderr, "ERROR: can't write %s\n", get_statsname(out_path, "columns.djdcol").c_str());
+            if (p_err) *p_err = columns_err;
+        }
+    }
+
+    // phases are summed over threads, so with jobs they may exceed wall time
+    const double wall_time = wall.elapsed();
+    m_times.writeJson(no_files ? std::string() : get_statsname(out_path, "perf.json"),
+                      "  \"wall\": " + std::to_string(wall_time) +
+                      ",\n  \"jobs\": " + std::to_string(jobs) +
+                      ",\n  \"io_threads\": " + std::to_string(opts->io_threads) +
+                      ",\n  \"bitmap_store\": " + std::to_string(store_time) +
+                      ",\n  \"dict_memory_peak\": " + std::to_string(m_dict_memory_peak));
+    if (opts->max_dict_memory_mb && m_dict_memory_peak > ((size_t) opts->max_dict_memory_mb << 20)) {
+        fprintf(stderr, "Warning: shared dictionaries took %.1f Mb, more than -max-dict-memory %d Mb\n",
+                m_dict_memory_peak / 1048576., opts->max_dict_memory_mb);
+    }
+    if (opts->verbose) {
+        fprintf(stdout, "Timings (summed over %d threads), wall time %.3f s:\n", jobs, wall_time);
+        m_times.printSummary(stdout);
+        fprintf(stdout, "  %-12s %10.3f s (in I/O threads: %d)\n", "bitmap_store", store_time, opts->io_threads);
+        fprintf(stdout, "Shared dictionaries peak memory: %.1f Mb\n", m_dict_memory_peak / 1048576.);
+    }
     return 1;
 }
 
@@ -777,6 +1493,10 @@ void LogFile::open(const char* fname)
     if (m_stats_f) {
         close();
     }
+    if (!fname || !*fname) { // not written
+        return;
+    }
+    PhaseTimer timer(m_times, PhaseTimes::ActionsLog);
     m_stats_f = fopen(fname, "wb");
 }
 
@@ -799,7 +1519,13 @@ const char* val_names[Counters::LastCounter] = {
                                "Local dictionary usage count",
                                "Elements on page",
                                "Unique bitmaps used on page",
-                               "Bitmaps added to local dictionary"
+                               "Bitmaps added to local dictionary",
+                               "Matching symbol index",
+                               "Matched symbol payload",
+                               "Dictionary cache hits",
+                               "Dictionary cache misses",
+                               "Shared dictionary refinements to library",
+                               "Local dictionary refinements to library"
                           };
 
 
@@ -821,6 +1547,7 @@ void LogFile::logAction(int32 action, int32 idx, bool in_shared_lib)
 {
     assert(action < 12);
     if (m_stats_f) {
+        PhaseTimer timer(m_times, PhaseTimes::ActionsLog);
         fprintf(m_stats_f, "%s:\t%u%s\n", val_names[action], idx, in_shared_lib?" [shared dictionary usage]":"");
         if (!in_shared_lib) {
 
@@ -834,6 +1561,7 @@ void LogFile::logAction(int32 action, int32 idx, bool in_shared_lib, int x, int
 {
     assert(action < 12);
     if (m_stats_f) {
+        PhaseTimer timer(m_times, PhaseTimes::ActionsLog);
         fprintf(m_stats_f, "%s:\tid: %u\tx: %u\ty: %u\t%s\n", val_names[action], idx, x, y, in_shared_lib?" [shared dictionary usage]":"");
         if (!in_shared_lib) {
 
@@ -847,6 +1575,7 @@ void LogFile::logAction(int32 action)
 {
     assert(action < 12);
     if (m_stats_f) {
+        PhaseTimer timer(m_times, PhaseTimes::ActionsLog);
         fprintf(m_stats_f, "%s\n", val_names[action]);
     }
 }
@@ -854,6 +1583,7 @@ void LogFile::logAction(int32 action)
 void LogFile::close()
 {
     if (m_stats_f) {
+        PhaseTimer timer(m_times, PhaseTimes::ActionsLog);
         if (m_counters) {
             for ( int i = 0; i < Counters::LastCounter; i++) {
                 log(m_counters->getValue((Counters::CountersType)i, m_totals).data());
@@ -874,10 +1604,26 @@ void Counters::resetPageCounters() {
 void Counters::clear() {
     resetPageCounters();
     memset(m_total_counters, 0, LastCounter*sizeof(int));
-    memset(m_total_sizes, 0, LastCounter*sizeof(int));
+    memset(m_total_sizes, 0, LastCounter*sizeof(double));
+}
+
+void Counters::merge(const Counters& page)
+{
+    for (int i = 0; i < LastCounter; i++) {
+        m_total_counters[i] += page.m_counters[i];
+        m_total_sizes[i] += page.m_sizes[i];
+    }
+}
+
+void Counters::mergeTotals(const Counters& other)
+{
+    for (int i = 0; i < LastCounter; i++) {
+        m_total_counters[i] += other.m_total_counters[i];
+        m_total_sizes[i] += other.m_total_sizes[i];
+    }
 }
 
-void Counters::count(CountersType cntr, int size, int val)
+void Counters::count(CountersType cntr, double size, int val)
 {
     assert(cntr < LastCounter);
     m_counters[cntr] += val;
@@ -890,11 +1636,11 @@ std::string Counters::getValue(CountersType cntr, bool total)
 {
     assert(cntr < LastCounter);
     int* buf = total? m_total_counters : m_counters;
-    int* buf_size = total? m_total_sizes : m_sizes;
+    double* buf_size = total? m_total_sizes : m_sizes;
     std::string val = ":\t" + std::to_string(buf[cntr]) +
-            " (" + std::to_string((double)(buf_size[cntr]*100/1024)/100) + " Kb";
+            " (" + std::to_string(buf_size[cntr]/8/1024) + " Kb";
     if (buf[cntr]) {
-        val += ", Avg.: " + std::to_string((double)buf_size[cntr]/buf[cntr]) + " b)\n";
+        val += ", Avg.: " + std::to_string(buf_size[cntr]/buf[cntr]) + " bits)\n";
     } else val += ")\n";
     return val_names[cntr] + val;
 }
@@ -1,33 +1,38 @@
 #ifndef JB2DUMPER_H
 #define JB2DUMPER_H
 
+#include "bitmapwriter.h"
+#include "columnar.h"
+#include "dictcache.h"
 #include "djvudict_options.h"
 #include "djvudirreader.h"
+#include "djvudocument.h"
+#include "formrecord.h"
+#include "jb2visitor.h"
+#include "phasetimes.h"
 #include "config.h"
 #ifdef HAVE_LIBSQLITE3
 #include "sqlstorage.h"
 #endif
 #include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
-#define CHUNK_ID_AT_AND_T 0x41542654
-#define CHUNK_ID_FORM     0x464F524D
-#define ID_DJVU           0x444A5655
-#define ID_DJVM           0x444A564D
-#define ID_DIRM           0x4449524D
-
-typedef struct IFFChunk
-{
-    uint32 id;
-    uint32 length;
-    uint32 skipped;
-    struct IFFChunk *parent;
-} IFFChunk;
+class WorkerPool;
+class IncrementalManifest;
+struct FormOutputs;
 
+// Decoded Djbz. Pages reference its bitmaps read-only, so it's shared
+// between pages (and threads) without copying.
 struct SharedDictInfo
 {
     mdjvu_bitmap_t * bitmaps;
     int32 count;
+    mdjvu_image_t image; // owns bitmaps
     const char* id; // not own
+    const char* dump_path; // folder with dictionary bitmaps, not own
+    size_t memory; // estimated size of bitmaps, bytes
 };
 
 class Counters
@@ -54,22 +59,64 @@ public:
         ElementsOnPage,
         UniqElementsOnPage,
         BitmapsAddedToLocalDict,
+        MatchingSymbolIndex,    // bits of matching_symbol_index in matched records
+        MatchedSymbolPayload,   // rest of matched records (refinement, position)
+        DictCacheHits,          // dictionaries replayed from -dict-cache
+        DictCacheMisses,        // dictionaries decoded with -dict-cache
+        SharedDictRefinements,  // refinements of shared symbols added to library
+        LocalDictRefinements,   // refinements of local symbols added to library
         LastCounter
     };
 
-    Counters(){}
+    Counters() { clear(); }
     ~Counters(){}
 
-    void count(CountersType, int size = 0, int val = 1);
+    // size is compressed size in bits
+    void count(CountersType, double size = 0, int val = 1);
+    // adds page counters of another object to totals
+    void merge(const Counters& page);
+    // adds totals of another object (e.g. of a document) to totals
+    void mergeTotals(const Counters& other);
     std::string getValue(CountersType cntr, bool total = false);
+    inline int total(CountersType cntr) const { return m_total_counters[cntr]; }
+    inline double totalSize(CountersType cntr) const { return m_total_sizes[cntr]; }
+    inline int page(CountersType cntr) const { return m_counters[cntr]; }
+    inline double pageSize(CountersType cntr) const { return m_sizes[cntr]; }
     void resetPageCounters();
     void clear();
 
 private:
     int m_counters[LastCounter];
     int m_total_counters[LastCounter];
-    int m_sizes[LastCounter];
-    int m_total_sizes[LastCounter];
+    double m_sizes[LastCounter];
+    double m_total_sizes[LastCounter];
+};
+
+// State of a single DIRM entry. Entries are dumped independently
+// (maybe in parallel) and committed to totals and SQL in DIRM order.
+struct DumpContext
+{
+    int index;              // position among dumped entries
+    int entry_no;           // position in DIRM
+    const DIRM_Entry* entry;
+    ChunkView form;
+    uint32 form_type;       // ID_DJVU, ID_DJVI...
+    int dict;               // index of entry with INCLuded dictionary or -1
+    std::string dump_path;
+    std::string stats_file; // stats.log of the entry
+    std::string perf_file;  // perf.json of the entry
+    int dpi;
+    Counters counters;      // page counters
+    PhaseTimes times;       // page timings
+    mdjvu_error_t err;
+    FormRecord record;      // rows for SQL and columnar outputs
+    JB2Form info;           // passed to visitors
+    DictTrace* trace;       // records of the dictionary for -dict-cache or NULL
+    bool skip;              // -incremental: outputs of the previous run are kept, counters restored
+    bool kept_rows;         // -incremental: dumped for its pages only, SQL rows of the previous run are kept
+    uint64_t hash;          // -incremental: of the JB2 data of the form
+    uint64_t dict_hash;     // -incremental: hash of the INCLuded dictionary or 0
+    std::vector<std::string> files; // -incremental: written by the entry
 };
 
 class JB2Dumper
@@ -78,20 +125,79 @@ public:
     JB2Dumper();
     ~JB2Dumper();
     void close();
-    int dumpMultiPage(FILE *f, const DIRM_Entry* entries, int size, const char* out_path, mdjvu_error_t *perr, const struct Options* opts);
+    // With a shared pool (batch of documents) pages are dumped there instead of
+    // a pool of opts->jobs threads.
+    int dumpMultiPage(const DjVuDocument& doc, const DIRM_Entry* entries, int size, const char* out_path, mdjvu_error_t *perr, const struct Options* opts,
+                      WorkerPool* shared_pool = NULL);
+    // totals, phases before dumpMultiPage() (DIRM decoding) may be added here
+    inline PhaseTimes& times() { return m_times; }
+    inline const Counters& counters() const { return m_counters; }
+    // receives events of all forms, not own
+    inline void setVisitor(JB2Visitor* visitor) { m_visitor = visitor; }
 private:
-    int dumpDjbz(FILE *f, IFFChunk *form, const char* out_path, SharedDictInfo *local_dict, mdjvu_error_t* p_err);
-    int dumpSjbz(FILE *f, IFFChunk *form, const char* out_path, mdjvu_error_t* p_err, const Options *opts);
-    mdjvu_image_t loadAndDumpJB2Image(FILE * f, int32 length, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, const char* out_path, mdjvu_error_t *perr);
-
-    Counters m_counters;
-
-    SharedDictInfo* m_shared_dicts;
+    void dumpEntry(const DjVuDocument& doc, DumpContext& ctx);
+    void commitEntry(DumpContext& ctx, mdjvu_error_t* p_err);
+    void runEntry(WorkerPool& pool, const DjVuDocument& doc, std::vector<DumpContext>& ctxs,
+                  const std::vector< std::vector<int> >& dependents, int idx);
+    void markDone(int idx);
+    void waitDone(int idx);
+    // Decoded dictionaries are freed as soon as the last page INCLuding them
+    // is dumped. With a memory budget dictionaries wait in the pool path
+    // until memory of others is freed.
+    bool admitDict(int idx);
+    void storeDict(int idx, const SharedDictInfo& dict);
+    void releaseDict(int idx);
+    // dictionaries to submit again after a change of memory use
+    std::vector<int> resumeDicts(bool decoded);
+    void freeDict(SharedDictInfo& dict);
+    // -incremental: marks entries to skip, their manifest records go to kept
+    void planIncremental(const DjVuDocument& doc, std::vector<DumpContext>& ctxs, const char* out_path,
+                         const IncrementalManifest& previous, IncrementalManifest& kept);
+    // -incremental: appends the record of a committed entry to the manifest,
+    // once its rows and bitmaps are written
+    void checkpointEntry(DumpContext& ctx);
+
+    int dumpDjbz(const DjVuDocument& doc, DumpContext& ctx, SharedDictInfo *local_dict);
+    // -dict-cache: replays a known dictionary or decodes and stores it
+    int dumpCachedDjbz(const DjVuDocument& doc, const ChunkView& dict, DumpContext& ctx, SharedDictInfo *local_dict);
+    void replayDict(DumpContext& ctx, const DictTrace& trace, mdjvu_image_t image,
+                    const std::vector<mdjvu_bitmap_t>& bitmaps, SharedDictInfo *local_dict);
+    int dumpSjbz(const DjVuDocument& doc, DumpContext& ctx);
+    mdjvu_image_t loadAndDumpJB2Image(FILE * f, int32 length, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, DumpContext& ctx);
+    mdjvu_image_t decodeJB2Image(const DjVuDocument& doc, const ChunkView& chunk, const SharedDictInfo* shared_library, SharedDictInfo* local_dict, DumpContext& ctx);
+    bool makeDumpPath(DumpContext& ctx);
+    // bitmap files, actions.log and SQL/columns rows are visitors of the form
+    void attachOutputs(DumpContext& ctx, FormOutputs& outputs);
+
+    Counters m_counters; // totals
+    PhaseTimes m_times; // totals
+
+    SharedDictInfo* m_shared_dicts; // a slot per dumped entry
     int m_shared_dict_cnt;
-    int m_dict_buf_allocated;
-    const char* m_cur_output_folder;
-    int m_cur_dpi;
-    int m_cur_entry_no;
+    const Options* m_opts;
+    BitmapWriter* m_writer;
+    ColumnarWriter m_columns;
+    bool m_save_to_sql;
+    bool m_collect_records; // FormRecord of entries is filled
+    JB2Visitor* m_visitor;
+    DictCache m_dict_cache;
+    bool m_track_files; // DumpContext::files are filled
+    IncrementalManifest* m_manifest; // -incremental: written during the run or NULL
+    const IncrementalManifest* m_previous;
+    std::string m_manifest_root; // output folder, files of the manifest are relative to it
+
+    std::vector<char> m_done;
+    std::mutex m_done_mutex;
+    std::condition_variable m_done_cv;
+
+    std::vector<int> m_dict_users; // pages INCLuding the dictionary that aren't dumped yet
+    std::vector<int> m_deferred_dicts; // over budget, not decoded yet
+    size_t m_dict_memory; // of decoded dictionaries alive
+    size_t m_dict_memory_peak;
+    size_t m_dict_memory_max; // largest dictionary
+    size_t m_dict_budget; // 0 - no limit
+    int m_dicts_decoding;
+    std::mutex m_dict_mutex;
 #ifdef HAVE_LIBSQLITE3
     SQLStorage m_sql;
 #endif
@@ -100,7 +206,7 @@ private:
 class LogFile
 {
 public:
-    LogFile(Counters* counters = NULL, bool totals = false): m_counters(counters), m_stats_f(NULL), m_totals(totals) { }
+    LogFile(Counters* counters = NULL, bool totals = false): m_counters(counters), m_stats_f(NULL), m_totals(totals), m_times(NULL) { }
     ~LogFile() { close(); }
     void open(const char* fname);
     void log(const char* val);
@@ -109,68 +215,14 @@ public:
     void logAction(int32 action, int32 idx, bool in_shared_lib, int x, int y);
     void logAction(int32 action);
     void close();
+    // time of writes goes to ActionsLog phase
+    inline void setTimes(PhaseTimes* times) { m_times = times; }
 private:
     Counters* m_counters;
     FILE* m_stats_f;
     bool m_totals;
+    PhaseTimes* m_times;
 };
 
 
-/* ========================================================================= */
-
-static uint32 read_uint32_most_significant_byte_first(FILE *f)
-{
-    uint32 r = fgetc(f) << 24;
-    r |= fgetc(f) << 16;
-    r |= fgetc(f) << 8;
-    r |= fgetc(f);
-    return r;
-}
-
-static uint16 read_uint16_most_significant_byte_first(FILE *f)
-{
-    return fgetc(f) << 8 | fgetc(f);
-}
-
-
-static void skip_in_chunk(IFFChunk *chunk, unsigned len)
-{   // tells every parent chunk that we skip len bytes
-    while (chunk)
-    {
-        chunk->skipped += len;
-        chunk = chunk->parent;
-    }
-}
-
-static void skip_to_next_sibling_chunk(FILE *file, IFFChunk *chunk)
-{
-    skip_in_chunk(chunk->parent, chunk->length + 8);
-    fseek(file, (chunk->length + 1) & ~1, SEEK_CUR);
-    chunk->id = read_uint32_most_significant_byte_first(file);
-    chunk->length = read_uint32_most_significant_byte_first(file);
-    chunk->skipped = 0;
-}
-
-static void get_child_chunk(FILE *file, IFFChunk *chunk, IFFChunk *parent)
-{
-    chunk->id = read_uint32_most_significant_byte_first(file);
-    chunk->length = read_uint32_most_significant_byte_first(file);
-    chunk->skipped = 0;
-    chunk->parent = parent;
-    skip_in_chunk(parent, 8);
-}
-
-static int find_sibling_chunk(FILE *file, IFFChunk *chunk, uint32 id)
-{
-    while (chunk->id != id)
-    {
-        if (chunk->parent && chunk->parent->skipped >= chunk->parent->length)
-            return 0;
-        skip_to_next_sibling_chunk(file, chunk);
-    }
-    return 1;
-}
-
-
-
 #endif // JB2DUMPER_H
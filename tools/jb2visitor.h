@@ -0,0 +1,68 @@
+#ifndef JB2VISITOR_H
+#define JB2VISITOR_H
+
+#include <minidjvu-mod/minidjvu-mod.h>
+#include "djvudict_options.h"
+
+/*
+ * Embeddable API of djvudict (libdjvudict.a): walks JB2 images of a document
+ * and passes what the dumper sees to a visitor, so metrics can be computed
+ * in-process without output files.
+ *
+ * Events of a form come in order from the thread that dumps it: beginForm(),
+ * dictionary() if the image uses a shared dictionary, record() for every
+ * JB2 record, endForm(). endForm() comes also when a corrupted image is left
+ * early (the dump returns the error). Records without a shape (start of image, required
+ * dictionary or reset, comment, end of data) have no bitmap. With
+ * opts->jobs != 1 events of different forms may come from different threads
+ * at once. Pointers are valid during the call.
+ */
+
+struct JB2Form
+{
+    int position;           // in DIRM
+    const char* id;
+    int type;               // 1 - page (Sjbz), 2 - shared dictionary (Djbz)
+    int width, height;      // from INFO, 0 for dictionaries
+    int version, dpi;
+    const char* dictionary; // id of INCLuded dictionary or NULL
+};
+
+struct JB2Record
+{
+    int type;               // JB2RecordType
+    int32 local_id;         // index in the dictionary of the form or -1
+    int32 x, y;             // position on the page, (0,0) is the left bottom corner
+    int32 w, h;             // of the bitmap; of the page for start of image,
+                            // shared dictionary size for required dictionary
+    bool to_image, to_library;
+    bool non_symbol;        // jb2_non_symbol_data
+    int32 match;            // index of matched (prototype) symbol or -1
+    bool from_shared;       // match is in shared dictionary
+    double bits;            // exact compressed size of the record
+    double index_bits;      // bits of match index
+    mdjvu_bitmap_t bitmap;  // shape of the record
+    bool new_bitmap;        // bitmap is decoded by this record, not copied
+    const char* filename;   // file the bitmap is saved to, empty without output folder
+    int32 image_index;      // of a bitmap decoded to the image only (img, non_symb files) or -1
+};
+
+class JB2Visitor
+{
+public:
+    virtual ~JB2Visitor() {}
+    virtual void beginForm(const JB2Form& /*form*/) {}
+    // shared dictionary bitmaps used by the page
+    virtual void dictionary(const JB2Form& /*form*/, int32 /*shared_count*/) {}
+    virtual void record(const JB2Form& /*form*/, const JB2Record& /*rec*/) {}
+    // bits - compressed size of the JB2 chunk
+    virtual void endForm(const JB2Form& /*form*/, double /*bits*/) {}
+};
+
+// Dumps djvu_filepath (single-page or bundled) and passes events to visitor.
+// Without out_path nothing is written; with it the outputs selected by
+// opts are created as by djvudict.
+uint32 djvu_visit_document(const char* djvu_filepath, JB2Visitor* visitor, const Options* opts,
+                           mdjvu_error_t* perr, const char* out_path = NULL);
+
+#endif // JB2VISITOR_H
@@ -0,0 +1,330 @@
+#include "packarchive.h"
+#include "pathutils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(windows) || defined(WIN32))
+#define NO_MMAP
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char PACK_MAGIC[] = "DJDPACK1";
+static const char PACK_INDEX_MAGIC[] = "DJDPIDX1";
+static const uint32 PACK_ENTRY_SIZE = 6*4 + 8;
+static const uint32 PACK_FOOTER_SIZE = 8 + 4 + 8 + 4 + 8;
+
+static void put_uint16(std::vector<unsigned char>& buf, uint16 v)
+{
+    buf.push_back(v & 0xFF);
+    buf.push_back(v >> 8);
+}
+
+static void put_uint32(std::vector<unsigned char>& buf, uint32 v)
+{
+    for (int i = 0; i < 4; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static void put_uint64(std::vector<unsigned char>& buf, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) buf.push_back((v >> (8*i)) & 0xFF);
+}
+
+static uint16 get_uint16(const unsigned char* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32 get_uint32(const unsigned char* p)
+{
+    return (uint32) p[0] | (uint32) p[1] << 8 | (uint32) p[2] << 16 | (uint32) p[3] << 24;
+}
+
+static uint64_t get_uint64(const unsigned char* p)
+{
+    return (uint64_t) get_uint32(p) | (uint64_t) get_uint32(p + 4) << 32;
+}
+
+static inline uint64_t pack_key(int32 form, int32 kind, int32 id)
+{
+    return (uint64_t) (uint32) form << 32 | (uint64_t) (kind & 0xFF) << 24 | (uint32) (id & 0xFFFFFF);
+}
+
+/* ========================================================================= */
+
+PackStore::PackStore(): m_f(NULL), m_pos(0) {}
+
+PackStore::~PackStore()
+{
+    if (m_f) {
+        fclose(m_f);
+    }
+}
+
+bool PackStore::open(const std::string& filename, mdjvu_error_t* perr)
+{
+    m_f = fopen(filename.c_str(), "wb");
+    if (!m_f || fwrite(PACK_MAGIC, 1, 8, m_f) != 8) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    m_pos = 8;
+    return true;
+}
+
+void PackStore::registerForm(int32 form, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_forms[form] = name;
+}
+
+bool PackStore::store(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& /*filename*/, int32 dpi, mdjvu_error_t* perr)
+{
+    const int32 w = mdjvu_bitmap_get_width(bitmap);
+    const int32 h = mdjvu_bitmap_get_height(bitmap);
+    const int32 row_size = (w + 7) / 8;
+    const unsigned char last_mask = w % 8 ? (unsigned char) (0xFF << (8 - w % 8)) : 0xFF;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    PackEntry e = { key.form, key.kind, key.id, w, h, dpi, m_pos };
+
+    m_row.resize(row_size);
+    for (int32 y = 0; y < h; y++) {
+        memcpy(m_row.data(), mdjvu_bitmap_access_packed_row(bitmap, y), row_size);
+        if (row_size) m_row[row_size - 1] &= last_mask;
+        if (fwrite(m_row.data(), 1, row_size, m_f) != (size_t) row_size) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+            return false;
+        }
+    }
+    m_pos += (uint64_t) row_size * h;
+    m_entries.push_back(e);
+    return true;
+}
+
+bool PackStore::finish(mdjvu_error_t* perr)
+{
+    if (!m_f) {
+        return true;
+    }
+
+    std::vector<unsigned char> buf;
+    const uint64_t forms_offset = m_pos;
+    for (std::map<int32, std::string>::const_iterator it = m_forms.begin(); it != m_forms.end(); ++it) {
+        put_uint32(buf, it->first);
+        put_uint16(buf, it->second.size());
+        buf.insert(buf.end(), it->second.begin(), it->second.end());
+    }
+    const uint64_t index_offset = forms_offset + buf.size();
+    for (size_t i = 0; i < m_entries.size(); i++) {
+        const PackEntry& e = m_entries[i];
+        put_uint32(buf, e.form);
+        put_uint32(buf, e.kind);
+        put_uint32(buf, e.id);
+        put_uint32(buf, e.width);
+        put_uint32(buf, e.height);
+        put_uint32(buf, e.dpi);
+        put_uint64(buf, e.offset);
+    }
+    put_uint64(buf, forms_offset);
+    put_uint32(buf, m_forms.size());
+    put_uint64(buf, index_offset);
+    put_uint32(buf, m_entries.size());
+    buf.insert(buf.end(), PACK_INDEX_MAGIC, PACK_INDEX_MAGIC + 8);
+
+    const bool ok = fwrite(buf.data(), 1, buf.size(), m_f) == buf.size();
+    const bool closed = fclose(m_f) == 0;
+    m_f = NULL;
+    if (!ok || !closed) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return false;
+    }
+    return true;
+}
+
+/* ========================================================================= */
+
+bool PackReader::map(const char* filename)
+{
+#ifndef NO_MMAP
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t) st.st_size <= (size_t) -1) {
+        void* p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            m_data = (unsigned char*) p;
+            m_size = st.st_size;
+            m_mapped = true;
+        }
+    }
+    ::close(fd); // the mapping stays
+    return m_mapped;
+#else
+    // no mmap: the archive is read in memory
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        return false;
+    }
+    size_t capacity = 0, len = 0;
+    for (;;) {
+        if (len == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            unsigned char* p = (unsigned char*) realloc(m_data, capacity);
+            if (!p) {
+                break;
+            }
+            m_data = p;
+        }
+        const size_t readed = fread(m_data + len, 1, capacity - len, f);
+        len += readed;
+        if (!readed) {
+            break;
+        }
+    }
+    const bool ok = !ferror(f);
+    fclose(f);
+    m_size = len;
+    return ok && len > 0;
+#endif
+}
+
+void PackReader::close()
+{
+    if (m_data) {
+#ifndef NO_MMAP
+        if (m_mapped) {
+            munmap(m_data, (size_t) m_size);
+        } else
+#endif
+        {
+            free(m_data);
+        }
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+bool PackReader::open(const char* filename, mdjvu_error_t* perr)
+{
+    close();
+    m_entries.clear();
+    m_forms.clear();
+    m_lookup.clear();
+
+    if (!map(filename)) {
+        close();
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return false;
+    }
+
+    const unsigned char* data = m_data;
+    const uint64_t size = m_size;
+    if (size < 8 + PACK_FOOTER_SIZE || memcmp(data, PACK_MAGIC, 8) ||
+            memcmp(data + size - 8, PACK_INDEX_MAGIC, 8)) {
+        fprintf(stderr, "%s is not a djvudict archive\n", filename);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return false;
+    }
+
+    const unsigned char* footer = data + size - PACK_FOOTER_SIZE;
+    const uint64_t forms_offset = get_uint64(footer);
+    const uint32 forms_count = get_uint32(footer + 8);
+    const uint64_t index_offset = get_uint64(footer + 12);
+    const uint32 index_count = get_uint32(footer + 20);
+    if (forms_offset > index_offset || index_offset > size - PACK_FOOTER_SIZE ||
+            (size - PACK_FOOTER_SIZE - index_offset) / PACK_ENTRY_SIZE < index_count) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return false;
+    }
+
+    const unsigned char* p = data + forms_offset;
+    for (uint32 i = 0; i < forms_count; i++) {
+        if (p + 6 > data + index_offset || p + 6 + get_uint16(p + 4) > data + index_offset) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return false;
+        }
+        const uint16 len = get_uint16(p + 4);
+        m_forms[(int32) get_uint32(p)] = std::string((const char*) p + 6, len);
+        p += 6 + len;
+    }
+
+    p = data + index_offset;
+    m_entries.resize(index_count);
+    for (uint32 i = 0; i < index_count; i++, p += PACK_ENTRY_SIZE) {
+        PackEntry& e = m_entries[i];
+        e.form = get_uint32(p);
+        e.kind = get_uint32(p + 4);
+        e.id = get_uint32(p + 8);
+        e.width = get_uint32(p + 12);
+        e.height = get_uint32(p + 16);
+        e.dpi = get_uint32(p + 20);
+        e.offset = get_uint64(p + 24);
+        if (e.width < 0 || e.height < 0 || e.offset > forms_offset ||
+                (uint64_t) ((e.width + 7) / 8) * e.height > forms_offset - e.offset) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return false;
+        }
+        m_lookup[pack_key(e.form, e.kind, e.id)] = i;
+    }
+    return true;
+}
+
+const PackEntry* PackReader::find(const SymbolKey& key) const
+{
+    std::unordered_map<uint64_t, size_t>::const_iterator it = m_lookup.find(pack_key(key.form, key.kind, key.id));
+    return it == m_lookup.end() ? NULL : &m_entries[it->second];
+}
+
+mdjvu_bitmap_t PackReader::load(const PackEntry& e) const
+{
+    mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(e.width, e.height);
+    const int32 row_size = (e.width + 7) / 8;
+    const unsigned char* p = m_data + e.offset;
+    for (int32 y = 0; y < e.height; y++, p += row_size) {
+        memcpy(mdjvu_bitmap_access_packed_row(bitmap, y), p, row_size);
+    }
+    return bitmap;
+}
+
+int unpack_archive(const char* pack_file, const char* out_path, mdjvu_error_t* perr)
+{
+    PackReader reader;
+    if (!reader.open(pack_file, perr)) {
+        return 0;
+    }
+
+    const std::vector<PackEntry>& entries = reader.entries();
+    const std::map<int32, std::string>& forms = reader.forms();
+    for (size_t i = 0; i < entries.size(); i++) {
+        const PackEntry& e = entries[i];
+        std::map<int32, std::string>::const_iterator form = forms.find(e.form);
+        if (form == forms.end() || e.kind < 0 || e.kind >= SymbolKindsCount) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return 0;
+        }
+        const std::string path = get_statsname(out_path, form->second);
+        if (mkpath(path)) {
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+            return 0;
+        }
+        const std::string filename = e.kind == SymbolPage ?
+                    get_filename(path, symbol_kind_names[e.kind]) :
+                    get_filename(path, symbol_kind_names[e.kind], e.id);
+
+        mdjvu_bitmap_t bitmap = reader.load(e);
+        const int res = mdjvu_save_bmp(bitmap, filename.c_str(), e.dpi, perr);
+        mdjvu_bitmap_destroy(bitmap);
+        if (!res) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,85 @@
+#ifndef PACKARCHIVE_H
+#define PACKARCHIVE_H
+
+#include "bitmapwriter.h"
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+/*
+ * Single-file archive of all bitmaps of a document (symbols.pack),
+ * an alternative to the tree of BMP files. All integers are little-endian.
+ *
+ *   header:  "DJDPACK1"
+ *   bitmaps: packed rows one after another, (width+7)/8 bytes per row,
+ *            most significant bit is the leftmost pixel, 1 - black
+ *   forms:   for every form: int32 form, uint16 name length, name
+ *            (name of the folder in directory layout: "<entry>_<id>")
+ *   index:   for every bitmap: int32 form, int32 kind, int32 id,
+ *            int32 width, int32 height, int32 dpi, uint64 offset
+ *   footer:  uint64 forms offset, uint32 forms count,
+ *            uint64 index offset, uint32 index count, "DJDPIDX1"
+ */
+
+struct PackEntry
+{
+    int32 form;
+    int32 kind; // SymbolKind
+    int32 id;
+    int32 width;
+    int32 height;
+    int32 dpi;
+    uint64_t offset;
+};
+
+class PackStore: public BitmapStore
+{
+public:
+    PackStore();
+    ~PackStore();
+
+    bool open(const std::string& filename, mdjvu_error_t* perr);
+    void registerForm(int32 form, const std::string& name);
+
+    bool store(mdjvu_bitmap_t bitmap, const SymbolKey& key, const std::string& filename, int32 dpi, mdjvu_error_t* perr);
+    bool finish(mdjvu_error_t* perr);
+private:
+    FILE* m_f;
+    uint64_t m_pos;
+    std::vector<unsigned char> m_row;
+    std::vector<PackEntry> m_entries;
+    std::map<int32, std::string> m_forms;
+    std::mutex m_mutex;
+};
+
+// Maps the archive and finds any bitmap in O(1). Offsets are 64-bit, so
+// the archive has its own mapping instead of the 32-bit DjVuDocument.
+class PackReader
+{
+public:
+    PackReader(): m_data(NULL), m_size(0), m_mapped(false) {}
+    ~PackReader() { close(); }
+    bool open(const char* filename, mdjvu_error_t* perr);
+    void close();
+
+    inline const std::vector<PackEntry>& entries() const { return m_entries; }
+    inline const std::map<int32, std::string>& forms() const { return m_forms; }
+    const PackEntry* find(const SymbolKey& key) const;
+    // creates a bitmap, caller should destroy it
+    mdjvu_bitmap_t load(const PackEntry& entry) const;
+private:
+    bool map(const char* filename);
+
+    unsigned char* m_data;
+    uint64_t m_size;
+    bool m_mapped; // else read in memory
+    std::vector<PackEntry> m_entries;
+    std::map<int32, std::string> m_forms;
+    std::unordered_map<uint64_t, size_t> m_lookup;
+};
+
+// recreates tree of BMP files from the archive
+int unpack_archive(const char* pack_file, const char* out_path, mdjvu_error_t* perr);
+
+#endif // PACKARCHIVE_H
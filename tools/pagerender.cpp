@@ -0,0 +1,139 @@
+#include "pagerender.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+struct BandBlit
+{
+    int32 x, top, bottom; // rows [top, bottom) of the page
+    mdjvu_bitmap_t bitmap;
+};
+
+static void write_int16(FILE* f, int32 v)
+{
+    fputc(v & 0xFF, f);
+    fputc((v >> 8) & 0xFF, f);
+}
+
+static void write_int32(FILE* f, int32 v)
+{
+    write_int16(f, v & 0xFFFF);
+    write_int16(f, (v >> 16) & 0xFFFF);
+}
+
+// ORs packed row src of width src_bytes into dest starting at pixel x
+static void or_row(unsigned char* dest, int32 dest_bytes, const unsigned char* src, int32 src_bytes, int32 x)
+{
+    for (int32 i = 0; i < src_bytes; i++) {
+        const unsigned char b = src[i];
+        if (!b) continue;
+        const int32 start = x + i * 8;
+        if (start < 0) {
+            if (start > -8) dest[0] |= (unsigned char) (b << -start);
+            continue;
+        }
+        const int32 d = start >> 3;
+        if (d >= dest_bytes) break;
+        const int32 s = start & 7;
+        dest[d] |= b >> s;
+        if (s && d + 1 < dest_bytes) {
+            dest[d + 1] |= (unsigned char) (b << (8 - s));
+        }
+    }
+}
+
+int save_page_bmp(mdjvu_image_t page, const char* filename, int32 dpi, mdjvu_error_t* perr, int32 band_rows)
+{
+    const int32 width = mdjvu_image_get_width(page);
+    const int32 height = mdjvu_image_get_height(page);
+    const int32 row_size = (width + 7) >> 3;
+    const int32 padded_row_size = (row_size + 3) & ~3;
+    const int32 data_size = padded_row_size * height;
+    const int32 dots_per_meter = (int32) (dpi * 100 / 2.54 + 0.5);
+
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return 0;
+    }
+
+    // BITMAPFILEHEADER, BITMAPINFOHEADER and palette: 0 - white, 1 - black
+    fputc('B', f);
+    fputc('M', f);
+    write_int32(f, 14 + 40 + 8 + data_size);
+    write_int32(f, 0);
+    write_int32(f, 14 + 40 + 8);
+    write_int32(f, 40);
+    write_int32(f, width);
+    write_int32(f, height);
+    write_int16(f, 1);
+    write_int16(f, 1);
+    write_int32(f, 0);
+    write_int32(f, data_size);
+    write_int32(f, dots_per_meter);
+    write_int32(f, dots_per_meter);
+    write_int32(f, 2);
+    write_int32(f, 2);
+    const unsigned char palette[8] = { 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0 };
+    fwrite(palette, 1, sizeof(palette), f);
+
+    // blits by bottom edge, lowest first, they join the band they reach
+    std::vector<BandBlit> blits;
+    const int32 blit_count = mdjvu_image_get_blit_count(page);
+    blits.reserve(blit_count);
+    for (int32 i = 0; i < blit_count; i++) {
+        BandBlit b;
+        b.bitmap = mdjvu_image_get_blit_bitmap(page, i);
+        b.x = mdjvu_image_get_blit_x(page, i);
+        b.top = mdjvu_image_get_blit_y(page, i);
+        b.bottom = b.top + mdjvu_bitmap_get_height(b.bitmap);
+        if (b.bottom > 0 && b.top < height && b.bottom > b.top &&
+                b.x < width && b.x + mdjvu_bitmap_get_width(b.bitmap) > 0) {
+            blits.push_back(b);
+        }
+    }
+    std::sort(blits.begin(), blits.end(), [](const BandBlit& a, const BandBlit& b) { return a.bottom > b.bottom; });
+
+    if (band_rows < 1) band_rows = 1;
+    std::vector<unsigned char> band((size_t) padded_row_size * std::min(band_rows, std::max(height, 1)));
+    std::vector<BandBlit> active;
+    size_t next = 0;
+    const unsigned char last_mask = (width & 7) ? (unsigned char) (0xFF << (8 - (width & 7))) : 0xFF;
+
+    for (int32 band_bottom = height; band_bottom > 0; band_bottom -= band_rows) {
+        const int32 band_top = std::max(0, band_bottom - band_rows);
+        std::fill(band.begin(), band.end(), 0);
+        while (next < blits.size() && blits[next].bottom > band_top) {
+            active.push_back(blits[next++]);
+        }
+
+        for (size_t i = 0; i < active.size(); i++) {
+            const BandBlit& b = active[i];
+            const int32 src_bytes = mdjvu_bitmap_get_packed_row_size(b.bitmap);
+            const int32 from = std::max(b.top, band_top);
+            const int32 to = std::min(b.bottom, band_bottom);
+            for (int32 y = from; y < to; y++) {
+                or_row(&band[(size_t) (y - band_top) * padded_row_size], row_size,
+                       mdjvu_bitmap_access_packed_row(b.bitmap, y - b.top), src_bytes, b.x);
+            }
+        }
+        // blits that don't reach bands above are done
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [band_top](const BandBlit& b) { return b.top >= band_top; }),
+                     active.end());
+
+        for (int32 y = band_bottom - 1; y >= band_top; y--) {
+            unsigned char* row = &band[(size_t) (y - band_top) * padded_row_size];
+            if (row_size) row[row_size - 1] &= last_mask;
+            fwrite(row, 1, padded_row_size, f);
+        }
+    }
+
+    const bool failed = ferror(f) != 0;
+    if (fclose(f) || failed) {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return 0;
+    }
+    return 1;
+}
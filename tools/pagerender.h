@@ -0,0 +1,16 @@
+#ifndef PAGERENDER_H
+#define PAGERENDER_H
+
+#include "../include/minidjvu-mod/minidjvu-mod.h"
+
+// rows of a band, ~300 Kb for a 600 dpi Letter page
+#define PAGE_BAND_ROWS 512
+
+// Writes JB2 image as 1-bit BMP (as mdjvu_save_bmp() does with the result of
+// mdjvu_render()) without rendering the whole page. Blits are composited into
+// bands of band_rows rows from the bottom of the page up, in the order BMP
+// stores rows, and every band is written before the next one is drawn.
+int save_page_bmp(mdjvu_image_t page, const char* filename, int32 dpi, mdjvu_error_t* perr,
+                  int32 band_rows = PAGE_BAND_ROWS);
+
+#endif // PAGERENDER_H
@@ -0,0 +1,119 @@
+#include "pathutils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if (defined(windows) || defined(WIN32))
+#include <windows.h>
+#include <direct.h>
+#define mkdir(dir, mode) _mkdir(dir)
+const char _dir_sep = '\\';
+#else
+#include <sys/stat.h>
+const char _dir_sep = '/';
+#endif
+
+char dir_sep_used(const std::string& s)
+{
+    const bool slash = s.find_first_of('/',0) !=std::string::npos;
+    const bool backslash = s.find_first_of('\\',0) !=std::string::npos;
+    if (slash != backslash) return slash? '/' : '\\';
+    return _dir_sep;
+}
+
+int mkpath(std::string path, int mode)
+{
+    char used_sep = dir_sep_used(path);
+
+    if (path.empty()) {
+        return 0;
+    }
+
+
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+
+    int pos = 0, res = 0;
+    while( (pos = path.find_first_of(used_sep, pos) ) != std::string::npos ) {
+        std::string dir = path.substr(0, pos++);
+        if (dir.size()) {
+            res = mkdir(dir.c_str(), mode);
+            if (res == -1 && errno != EEXIST) {
+                fprintf(stderr, "mkdir failed for %s (error code %u, errno: %d - %s)", path.data(), res, errno, strerror(errno));
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+std::string get_subdir_name(const std::string& dir, int id)
+{
+    return std::to_string(id) + '_' + dir;
+}
+
+std::string get_subdir(std::string path, const std::string dir, int id)
+{
+    if (path.empty()) { // no output folder, no file names
+        return std::string();
+    }
+    char used_sep = dir_sep_used(path);
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+    return path + get_subdir_name(dir, id) + used_sep;
+}
+
+std::string get_filename(std::string path, std::string name)
+{
+    if (path.empty()) {
+        return std::string();
+    }
+    char used_sep = dir_sep_used(path);
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+    return path + name + ".bmp";
+}
+
+std::string get_filename(std::string path, std::string prefix, int id, int padding)
+{
+    if (path.empty()) {
+        return std::string();
+    }
+    char used_sep = dir_sep_used(path);
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+    std::string num = std::to_string(id);
+    while (num.length() < padding) num = '0' + num;
+
+    if (!prefix.empty()) prefix += '_';
+    return path + prefix + num + ".bmp";
+}
+
+std::string get_statsname(std::string path, std::string filename)
+{
+    if (path.empty()) {
+        return std::string();
+    }
+    char used_sep = dir_sep_used(path);
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+    return path + filename;
+}
+
+std::string get_sqlname(std::string path)
+{
+    if (path.empty()) {
+        return std::string();
+    }
+    char used_sep = dir_sep_used(path);
+    if ( path[path.length()-1] != used_sep) {
+        path += used_sep;
+    }
+    return path + "djvu_sqlite.db";
+}
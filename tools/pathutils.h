@@ -0,0 +1,19 @@
+#ifndef PATHUTILS_H
+#define PATHUTILS_H
+
+#include <string>
+
+// Layout of the output folder
+
+char dir_sep_used(const std::string& s);
+int mkpath(std::string path, int mode = 0755);
+// "<id>_<dir>" - name of the folder of DIRM entry
+std::string get_subdir_name(const std::string& dir, int id);
+// path helpers below return an empty name for an empty path (no output folder)
+std::string get_subdir(std::string path, const std::string dir, int id);
+std::string get_filename(std::string path, std::string name);
+std::string get_filename(std::string path, std::string prefix, int id, int padding = 5);
+std::string get_statsname(std::string path, std::string filename);
+std::string get_sqlname(std::string path);
+
+#endif // PATHUTILS_H
@@ -0,0 +1,91 @@
+#include "phasetimes.h"
+#include <stdio.h>
+
+static const char* phase_names[PhaseTimes::PhasesCount] = {
+    "dirm_decode",
+    "jb2_decode",
+    "bitmap_save",
+    "make_dirs",
+    "page_render",
+    "actions_log",
+    "sql_insert",
+    "columns_write",
+    "dict_cache"
+};
+
+const char* PhaseTimes::name(Phase phase)
+{
+    return phase_names[phase];
+}
+
+void PhaseTimes::clear()
+{
+    for (int i = 0; i < PhasesCount; i++) {
+        m_seconds[i] = 0;
+    }
+}
+
+double PhaseTimes::sum() const
+{
+    double res = 0;
+    for (int i = 0; i < PhasesCount; i++) {
+        res += m_seconds[i];
+    }
+    return res;
+}
+
+void PhaseTimes::merge(const PhaseTimes& other)
+{
+    for (int i = 0; i < PhasesCount; i++) {
+        m_seconds[i] += other.m_seconds[i];
+    }
+}
+
+bool PhaseTimes::writeJson(const std::string& filename, const std::string& extra) const
+{
+    if (filename.empty()) { // not written
+        return false;
+    }
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    fprintf(f, "{\n");
+    if (!extra.empty()) {
+        fprintf(f, "%s,\n", extra.c_str());
+    }
+    fprintf(f, "  \"phases\": {\n");
+    for (int i = 0; i < PhasesCount; i++) {
+        fprintf(f, "    \"%s\": %.6f%s\n", phase_names[i], m_seconds[i], i + 1 < PhasesCount ? "," : "");
+    }
+    fprintf(f, "  },\n  \"total\": %.6f\n}\n", sum());
+    return fclose(f) == 0;
+}
+
+std::string json_string(const char* s)
+{
+    std::string res = "\"";
+    for (; s && *s; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            sprintf(buf, "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res + "\"";
+}
+
+void PhaseTimes::printSummary(FILE* f) const
+{
+    const double total = sum();
+    for (int i = 0; i < PhasesCount; i++) {
+        fprintf(f, "  %-12s %10.3f s %5.1f%%\n", phase_names[i], m_seconds[i],
+                total > 0 ? m_seconds[i] * 100 / total : 0.);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef PHASETIMES_H
+#define PHASETIMES_H
+
+#include <chrono>
+#include <string>
+
+// Time spent in phases of the dump, by monotonic clock
+class PhaseTimes
+{
+public:
+    enum Phase
+    {
+        DirmDecode,     // DIRM and its BZZ stream
+        JB2Decode,      // JB2 streams, without saving and logging below
+        BitmapSave,     // BMP encoding and writing (or queueing with I/O threads)
+        MakeDirs,
+        PageRender,
+        ActionsLog,
+        SQLInsert,
+        ColumnsWrite,   // columnar export
+        DictCache,      // reading and writing -dict-cache files
+        PhasesCount
+    };
+
+    PhaseTimes() { clear(); }
+
+    void clear();
+    inline void add(Phase phase, double seconds) { m_seconds[phase] += seconds; }
+    inline double get(Phase phase) const { return m_seconds[phase]; }
+    double sum() const;
+    void merge(const PhaseTimes& other);
+
+    // writes {"phases": {...}, <extra>} where extra is already formatted JSON members
+    bool writeJson(const std::string& filename, const std::string& extra = std::string()) const;
+    void printSummary(FILE* f) const;
+
+    static const char* name(Phase phase);
+private:
+    double m_seconds[PhasesCount];
+};
+
+class Stopwatch
+{
+public:
+    Stopwatch(): m_start(std::chrono::steady_clock::now()) {}
+    // seconds since construction
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Adds time of its scope to the phase. Does nothing without PhaseTimes.
+class PhaseTimer: public Stopwatch
+{
+public:
+    PhaseTimer(PhaseTimes* times, PhaseTimes::Phase phase): m_times(times), m_phase(phase) {}
+    ~PhaseTimer()
+    {
+        if (m_times) m_times->add(m_phase, elapsed());
+    }
+private:
+    PhaseTimes* m_times;
+    PhaseTimes::Phase m_phase;
+};
+
+// quoted and escaped JSON string
+std::string json_string(const char* s);
+
+#endif // PHASETIMES_H
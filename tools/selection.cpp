@@ -0,0 +1,53 @@
+#include "selection.h"
+#include <limits.h>
+#include <stdlib.h>
+
+static bool parse_number(const char*& p, int* res)
+{
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    char* end;
+    const long val = strtol(p, &end, 10);
+    if (val > INT_MAX) {
+        return false;
+    }
+    *res = val;
+    p = end;
+    return true;
+}
+
+bool RangeSelection::parse(const char* spec)
+{
+    m_ranges.clear();
+    const char* p = spec;
+    do {
+        int first, last;
+        if (!parse_number(p, &first)) {
+            return false;
+        }
+        last = first;
+        if (*p == '-') {
+            p++;
+            last = INT_MAX;
+            if (*p && *p != ',' && !parse_number(p, &last)) {
+                return false;
+            }
+        }
+        if (last < first || (*p && *p != ',')) {
+            return false;
+        }
+        m_ranges.push_back(std::make_pair(first, last));
+    } while (*p++ == ',');
+    return true;
+}
+
+bool RangeSelection::contains(int n) const
+{
+    for (size_t i = 0; i < m_ranges.size(); i++) {
+        if (n >= m_ranges[i].first && n <= m_ranges[i].second) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,22 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include <utility>
+#include <vector>
+
+// Numbers of -pages (1-based page numbers) and -entries (DIRM positions, as
+// in folder names): "500-520,600,700-" - ranges, single numbers and open
+// ranges to the end, separated by commas.
+class RangeSelection
+{
+public:
+    // false on a syntax error
+    bool parse(const char* spec);
+    inline bool empty() const { return m_ranges.empty(); }
+    bool contains(int n) const;
+
+private:
+    std::vector< std::pair<int, int> > m_ranges; // first, last (inclusive)
+};
+
+#endif // SELECTION_H
@@ -4,18 +4,116 @@
 #include <cassert>
 #include <cstring>
 
-SQLStorage::SQLStorage(): m_storage(nullptr)
+#ifdef HAVE_LIBSQLITE3
+
+static inline unsigned long long letter_key(sqlite3_int64 form_id, int local_id)
+{
+    return (unsigned long long) form_id << 32 | (unsigned int) local_id;
+}
+
+SQLStorage::SQLStorage(): m_storage(nullptr), m_storage_on_disk(nullptr),
+    m_insert_form(nullptr), m_insert_sjbz(nullptr), m_insert_letter(nullptr), m_insert_bitmap(nullptr),
+    m_in_transaction(false), m_direct(false), m_uncommitted_rows(0)
+{
+}
+
+bool
+SQLStorage::init(const char* filename, bool direct, int cache_mb)
+{
+    m_direct = direct;
+    if ( !(open(filename, cache_mb) &&
+           clear() &&
+           create() &&
+           prepare() &&
+           exec("BEGIN TRANSACTION; ", "init")) ) {
+        return false;
+    }
+    m_in_transaction = true;
+    return true;
+}
+
+bool
+SQLStorage::resume(const char* filename, int cache_mb, const std::set<int>& kept)
+{
+    m_direct = true;
+    if (!open(filename, cache_mb)) {
+        return false;
+    }
+    if (!has_tables()) { // nothing was committed
+        if (!(create() && prepare() && exec("BEGIN TRANSACTION; ", "resume"))) {
+            return false;
+        }
+        m_in_transaction = true;
+        return true;
+    }
+
+    std::string positions;
+    for (std::set<int>::const_iterator it = kept.begin(); it != kept.end(); ++it) {
+        positions += (positions.empty() ? "" : ", ") + std::to_string(*it);
+    }
+    const std::string dropped = "(SELECT id FROM forms WHERE position NOT IN (" + positions + "))";
+    // letters of dropped forms refer only to dropped forms, index is built again at the end
+    const std::string sql = "PRAGMA foreign_keys = ON; "
+                            "PRAGMA temp_store=MEMORY; "
+                            "BEGIN TRANSACTION; "
+                            "DELETE FROM letters WHERE form_id IN " + dropped + "; "
+                            "DELETE FROM sjbz_info WHERE form_id IN " + dropped + "; "
+                            "DELETE FROM forms WHERE id IN " + dropped + "; "
+                            "DROP INDEX IF EXISTS index_letters; "
+                            "COMMIT TRANSACTION; ";
+    if (!(exec(sql.c_str(), "resume") && load_ids() && prepare() && exec("BEGIN TRANSACTION; ", "resume"))) {
+        return false;
+    }
+    m_in_transaction = true;
+    return true;
+}
+
+bool
+SQLStorage::has_tables()
 {
-    m_cur_form_id = m_cur_djbz_id = -1;
+    sqlite3_stmt* st = nullptr;
+    if (sqlite3_prepare_v2(m_storage, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'forms'; ",
+                           -1, &st, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    const bool res = sqlite3_step(st) == SQLITE_ROW;
+    sqlite3_finalize(st);
+    return res;
 }
 
+// ids of kept forms, their Djbz letters and stored bitmaps
 bool
-SQLStorage::init(const char* filename)
+SQLStorage::load_ids()
 {
-    return ( open(filename) &&
-             clear() &&
-             create()
-             );
+    const char* queries[3] = {
+        "SELECT id, entry_name FROM forms; ",
+        "SELECT l.form_id, l.local_id, l.id FROM letters l JOIN forms f ON f.id = l.form_id "
+        "WHERE f.type = 2 AND l.local_id IS NOT NULL; ",
+        "SELECT hash FROM bitmaps; "
+    };
+    for (int q = 0; q < 3; q++) {
+        sqlite3_stmt* st = nullptr;
+        if (sqlite3_prepare_v2(m_storage, queries[q], -1, &st, nullptr) != SQLITE_OK) {
+            fprintf(stderr, _("Error in SQLStorage::load_ids() SQL prepare: %s\n"), sqlite3_errmsg(m_storage));
+            return false;
+        }
+        int res;
+        while ((res = sqlite3_step(st)) == SQLITE_ROW) {
+            if (q == 0) {
+                m_form_ids[(const char*) sqlite3_column_text(st, 1)] = sqlite3_column_int64(st, 0);
+            } else if (q == 1) {
+                m_letter_ids[letter_key(sqlite3_column_int64(st, 0), sqlite3_column_int(st, 1))] = sqlite3_column_int64(st, 2);
+            } else {
+                m_bitmap_hashes.insert((unsigned long long) sqlite3_column_int64(st, 0));
+            }
+        }
+        sqlite3_finalize(st);
+        if (res != SQLITE_DONE) {
+            fprintf(stderr, _("Error in SQLStorage::load_ids() SQL exec: %s\n"), sqlite3_errmsg(m_storage));
+            return false;
+        }
+    }
+    return true;
 }
 
 SQLStorage::~SQLStorage()
@@ -25,7 +123,21 @@ SQLStorage::~SQLStorage()
 
 
 bool
-SQLStorage::open(const char* filename) {
+SQLStorage::open(const char* filename, int cache_mb) {
+    if (m_direct) {
+        const int res = sqlite3_open_v2(filename, &m_storage, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+        if( res != SQLITE_OK ) {
+            fprintf(stderr, _("Can't open sql database (%s): %d (%s)\n"), filename, res, sqlite3_errmsg(m_storage));
+            return false;
+        }
+        // WAL with NORMAL sync: commits are cheap appends, the database is consistent after a crash
+        std::string sql = "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; ";
+        if (cache_mb > 0) {
+            sql += "PRAGMA cache_size=-" + std::to_string(cache_mb * 1024) + "; ";
+        }
+        return exec(sql.c_str(), "open");
+    }
+
     int res = sqlite3_open_v2(":memory:", &m_storage, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY, nullptr);
 
     if( res != SQLITE_OK ) {
@@ -39,7 +151,7 @@ SQLStorage::open(const char* filename) {
         return false;
     }
 
-    return true;
+    return exec("PRAGMA journal_mode=MEMORY; ", "open");
 }
 
 bool
@@ -47,11 +159,13 @@ SQLStorage::clear()
 {
     const char* sql = "DROP INDEX IF EXISTS index_letters; "
                       "DROP TABLE IF EXISTS letters; "
+                      "DROP TABLE IF EXISTS bitmaps; "
                       "DROP TABLE IF EXISTS sjbz_info; "
                       "DROP TABLE IF EXISTS forms; ";
 
     char *err = nullptr;
-    int res = sqlite3_exec(m_storage_on_disk, sql, nullptr, nullptr, &err);
+    // in direct mode m_storage is the on-disk database
+    int res = sqlite3_exec(m_direct ? m_storage : m_storage_on_disk, sql, nullptr, nullptr, &err);
     if ( res != SQLITE_OK ) {
         fprintf(stderr, _("Error in SQLStorage::clear() SQL exec: %d (%s)\n"), res, err);
         sqlite3_free(err);
@@ -67,7 +181,6 @@ SQLStorage::create()
     const char* sql =
             "PRAGMA foreign_keys = ON; "
             "PRAGMA temp_store=MEMORY; "
-            "PRAGMA journal_mode=MEMORY; "
 "CREATE TABLE forms ( "
 "    id           INTEGER PRIMARY KEY AUTOINCREMENT "
 "                         UNIQUE, "
@@ -89,6 +202,14 @@ SQLStorage::create()
 "    version  INTEGER NOT NULL "
 "); "
 
+// distinct bitmaps of letters, with -format sql
+"CREATE TABLE bitmaps ( "
+"    hash     INTEGER PRIMARY KEY, " // 64-bit FNV-1a of width, height and data
+"    width    INTEGER NOT NULL, "
+"    height   INTEGER NOT NULL, "
+"    data     BLOB NOT NULL " // rows of (width+7)/8 bytes, MSB is the leftmost pixel
+"); "
+
 "CREATE TABLE letters ( "
 "    id                 INTEGER PRIMARY KEY AUTOINCREMENT "
 "                               NOT NULL "
@@ -106,10 +227,11 @@ SQLStorage::create()
 "    reference_id       INTEGER REFERENCES letters (id), " // if not NULL then
 "    is_refinement      INTEGER, " // 0 - copy of reference_id, 1 - refinement of reference_id
 
-"    filename           STRING "
-"); "
-
-"CREATE INDEX index_letters ON letters(form_id, local_id); ";
+"    filename           STRING, "
+"    compressed_bits    REAL, " // size of JB2 record
+"    index_bits         REAL, " // part of compressed_bits spent on matching symbol index
+"    bitmap_hash        INTEGER REFERENCES bitmaps (hash) " // NULL if bitmaps aren't stored
+"); ";
 
 
     char *err = nullptr;
@@ -123,186 +245,226 @@ SQLStorage::create()
 }
 
 
-void
-SQLStorage::close()
+// after the bulk load, it's cheaper than updating the index on every insert
+bool
+SQLStorage::create_indexes()
 {
-    if (m_storage_on_disk) {
-        sqlite3_close(m_storage_on_disk);
-    }
+    return exec("CREATE INDEX index_letters ON letters(form_id, local_id); ", "create_indexes");
+}
 
-    if (m_storage) {
-        sqlite3_close(m_storage);
+bool
+SQLStorage::prepare()
+{
+    const struct { sqlite3_stmt** stmt; const char* sql; } stmts[] = {
+        { &m_insert_form, "INSERT INTO forms VALUES(NULL, ?, ?, ?, ?); " },
+        { &m_insert_sjbz, "INSERT INTO sjbz_info VALUES(?, ?, ?, ?, ?, ?); " },
+        { &m_insert_letter, "INSERT INTO letters VALUES(NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?); " },
+        { &m_insert_bitmap, "INSERT OR IGNORE INTO bitmaps VALUES(?, ?, ?, ?); " }
+    };
+    for (size_t i = 0; i < sizeof(stmts)/sizeof(stmts[0]); i++) {
+        const int res = sqlite3_prepare_v2(m_storage, stmts[i].sql, -1, stmts[i].stmt, nullptr);
+        if ( res != SQLITE_OK ) {
+            fprintf(stderr, _("Error in SQLStorage::prepare() SQL prepare: %d (%s)\n"), res, sqlite3_errmsg(m_storage));
+            return false;
+        }
     }
+    return true;
 }
 
-void
-SQLStorage::start_new_form(int position, const char* entry_name, const char* dump_path)
+bool
+SQLStorage::exec(const char* sql, const char* where)
 {
-    assert(m_cur_form_id == -1);
-
     char *err = nullptr;
-    char sql[1024];
-    sprintf(sql, "INSERT INTO forms VALUES(NULL, %d, '%s', %u, '%s'); ", position, entry_name, 0, dump_path);
-
     const int res = sqlite3_exec(m_storage, sql, nullptr, nullptr, &err);
     if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::start_new_form() SQL exec: %d (%s)\n"), res, err);
+        fprintf(stderr, _("Error in SQLStorage::%s() SQL exec: %d (%s)\n"), where, res, err);
         sqlite3_free(err);
-        exit(3);
+        return false;
     }
-
-    m_cur_form_id = sqlite3_last_insert_rowid(m_storage);
-    assert(m_cur_form_id != -1);
+    return true;
 }
 
 void
-SQLStorage::start_new_sjbz(int w, int h, int version, int dpi)
+SQLStorage::close()
 {
-    assert(m_cur_form_id != -1);
-
-    char *err = nullptr;
-    char sql[1024];
+    sqlite3_finalize(m_insert_form);
+    sqlite3_finalize(m_insert_sjbz);
+    sqlite3_finalize(m_insert_letter);
+    sqlite3_finalize(m_insert_bitmap);
+    m_insert_form = m_insert_sjbz = m_insert_letter = m_insert_bitmap = nullptr;
 
-    sprintf(sql, "UPDATE forms SET type = 1 WHERE id = %u; ", m_cur_form_id);
-
-    int res = sqlite3_exec(m_storage, sql, nullptr, nullptr, &err);
-    if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::start_new_sjbz() SQL exec: %d (%s)\n"), res, err);
-        sqlite3_free(err);
-        exit(3);
-    }
-
-
-    sprintf(sql, "INSERT INTO sjbz_info VALUES(%u, ", m_cur_form_id);
-
-    if (m_cur_djbz_id != -1) {
-        sprintf(sql+strlen(sql), "%u, ", m_cur_djbz_id);
-    } else {
-        sprintf(sql+strlen(sql), "NULL, ");
+    if (m_storage_on_disk) {
+        sqlite3_close(m_storage_on_disk);
     }
 
-    sprintf(sql+strlen(sql), "%u, %u, %u, %u); ", w, h, dpi, version);
-
-    res = sqlite3_exec(m_storage, sql, nullptr, nullptr, &err);
-    if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::start_new_sjbz():2 SQL exec: %d (%s)\n"), res, err);
-        sqlite3_free(err);
-        exit(3);
+    if (m_storage) {
+        sqlite3_close(m_storage);
     }
-
 }
 
 void
-SQLStorage::start_new_djbz()
+SQLStorage::step(sqlite3_stmt* stmt, const char* where)
 {
-    assert(m_cur_form_id != -1);
-    assert(m_cur_djbz_id == -1);
-
-    char *err = nullptr;
-    char sql[1024];
-
-    sprintf(sql, "UPDATE forms SET type = 2 WHERE id = %u; ", m_cur_form_id);
-
-    const int res = sqlite3_exec(m_storage, sql, nullptr, nullptr, &err);
-    if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::start_new_djbz() SQL exec: %d (%s)\n"), res, err);
-        sqlite3_free(err);
+    const int res = sqlite3_step(stmt);
+    if ( res != SQLITE_DONE ) {
+        fprintf(stderr, _("Error in SQLStorage::%s() SQL exec: %d (%s)\n"), where, res, sqlite3_errmsg(m_storage));
         exit(3);
     }
-
-    m_cur_djbz_id = sqlite3_last_insert_rowid(m_storage);
-    assert(m_cur_djbz_id != -1);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
 }
 
-static int callback_set_id(void* id_to_set,int clmn_count,char** clmn_vals, char** /*clmn_names*/)
+sqlite3_int64
+SQLStorage::letter_id(sqlite3_int64 form_id, int local_id) const
 {
-    assert(id_to_set);
-    assert(clmn_count == 1);
-    assert(clmn_vals[0]);
-    *((int*)id_to_set) = atoi(clmn_vals[0]);
-    return 0;
+    std::unordered_map<unsigned long long, sqlite3_int64>::const_iterator it = m_letter_ids.find(letter_key(form_id, local_id));
+    assert(it != m_letter_ids.end());
+    return it == m_letter_ids.end() ? -1 : it->second;
 }
 
 void
-SQLStorage::use_djbz(const char* entry_name)
+SQLStorage::add_letter(const FormRecord::Letter& l, sqlite3_int64 form_id, sqlite3_int64 djbz_id)
 {
-    assert(m_cur_djbz_id == -1);
-    char *err = nullptr;
-    char sql[1024];
+    sqlite3_int64 ref_id = -1;
+    if (l.ref_local_id != -1) {
+        assert(!l.from_djbz || djbz_id != -1);
+        ref_id = letter_id(l.from_djbz ? djbz_id : form_id, l.ref_local_id);
+    }
 
-    sprintf(sql, " SELECT id FROM forms WHERE entry_name = '%s'; ", entry_name);
+    sqlite3_stmt* st = m_insert_letter;
+    sqlite3_bind_int64(st, 1, form_id);
+    if (l.local_id != -1) {
+        sqlite3_bind_int(st, 2, l.local_id);
+    }
+    sqlite3_bind_int(st, 3, l.x);
+    sqlite3_bind_int(st, 4, l.y);
+    sqlite3_bind_int(st, 5, l.w);
+    sqlite3_bind_int(st, 6, l.h);
+    sqlite3_bind_int(st, 7, l.to_image);
+    sqlite3_bind_int(st, 8, l.to_library);
+    sqlite3_bind_int(st, 9, l.is_non_symbol);
+    if (ref_id != -1) {
+        sqlite3_bind_int64(st, 10, ref_id);
+    }
+    sqlite3_bind_int(st, 11, l.is_refinement);
+    sqlite3_bind_text(st, 12, l.filename.c_str(), l.filename.size(), SQLITE_STATIC);
+    sqlite3_bind_double(st, 13, l.bits);
+    sqlite3_bind_double(st, 14, l.index_bits);
+    if (l.bitmap_hash) {
+        sqlite3_bind_int64(st, 15, (sqlite3_int64) l.bitmap_hash);
+    }
+    step(st, "add_letter");
 
-    const int res = sqlite3_exec(m_storage, sql, callback_set_id, &m_cur_djbz_id, &err);
-    if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::use_djbz() SQL exec: %d (%s)\n"), res, err);
-        sqlite3_free(err);
-        exit(3);
+    if (l.local_id != -1) {
+        m_letter_ids[letter_key(form_id, l.local_id)] = sqlite3_last_insert_rowid(m_storage);
     }
 }
 
 void
-SQLStorage::add_letter(int local_id, int x, int y, int w, int h,
-                       int to_image, int to_library, int is_non_symbol,
-                       int ref_local_id, int from_djbz,
-                       int is_refinement, const char* filename)
+SQLStorage::add_bitmap(const FormRecord::Bitmap& b)
 {
-    assert(m_cur_form_id != -1);
-
-    char *err = nullptr;
-    char sql[1024];
-
-    int entity_ref = -1;
-    int _ref_global_id = -1;
-
-    if (ref_local_id != -1) {
-        entity_ref = from_djbz ? m_cur_djbz_id : m_cur_form_id;
-        assert(entity_ref != -1);
-
-        sprintf(sql, "SELECT id FROM letters WHERE form_id = %u AND local_id = %u ; ",
-                entity_ref, ref_local_id);
-
-        const int res = sqlite3_exec(m_storage, sql, callback_set_id, &_ref_global_id, &err);
-        if ( res != SQLITE_OK ) {
-            fprintf(stderr, _("Error in SQLStorage::add_letter():1 SQL exec: %d (%s)\n"), res, err);
-            sqlite3_free(err);
-            exit(3);
-        }
-        assert(_ref_global_id != -1);
+    if (!m_bitmap_hashes.insert(b.hash).second) {
+        return;
     }
-
-    sprintf(sql, "INSERT INTO letters VALUES (NULL, %u, ",
-            m_cur_form_id);
-
-    if (local_id != -1) {
-        sprintf(sql+strlen(sql), "%u, ", local_id);
+    sqlite3_bind_int64(m_insert_bitmap, 1, (sqlite3_int64) b.hash);
+    sqlite3_bind_int(m_insert_bitmap, 2, b.w);
+    sqlite3_bind_int(m_insert_bitmap, 3, b.h);
+    if (b.data.empty()) {
+        sqlite3_bind_zeroblob(m_insert_bitmap, 4, 0);
     } else {
-        sprintf(sql+strlen(sql), "NULL, ");
+        sqlite3_bind_blob(m_insert_bitmap, 4, b.data.data(), b.data.size(), SQLITE_STATIC);
     }
+    step(m_insert_bitmap, "add_bitmap");
+}
 
-    sprintf(sql+strlen(sql), "%u, %u, %u, %u, %u, %u, %u, ",
-            x, y, w, h, to_image, to_library, is_non_symbol);
-
+void
+SQLStorage::add_form(int position, const char* entry_name, const char* dump_path, const FormRecord& rec)
+{
+    sqlite3_bind_int(m_insert_form, 1, position);
+    sqlite3_bind_text(m_insert_form, 2, entry_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(m_insert_form, 3, rec.type);
+    sqlite3_bind_text(m_insert_form, 4, dump_path, -1, SQLITE_STATIC);
+    step(m_insert_form, "add_form");
+
+    const sqlite3_int64 form_id = sqlite3_last_insert_rowid(m_storage);
+    m_form_ids[entry_name] = form_id;
+
+    sqlite3_int64 djbz_id = -1;
+    if (rec.type == 2) {
+        djbz_id = form_id;
+    } else if (rec.type == 1) {
+        if (rec.djbz_name) {
+            std::unordered_map<std::string, sqlite3_int64>::const_iterator it = m_form_ids.find(rec.djbz_name);
+            if (it != m_form_ids.end()) {
+                djbz_id = it->second;
+            }
+        }
+        sqlite3_bind_int64(m_insert_sjbz, 1, form_id);
+        if (djbz_id != -1) {
+            sqlite3_bind_int64(m_insert_sjbz, 2, djbz_id);
+        }
+        sqlite3_bind_int(m_insert_sjbz, 3, rec.w);
+        sqlite3_bind_int(m_insert_sjbz, 4, rec.h);
+        sqlite3_bind_int(m_insert_sjbz, 5, rec.dpi);
+        sqlite3_bind_int(m_insert_sjbz, 6, rec.version);
+        step(m_insert_sjbz, "add_form");
+    }
 
-    if (_ref_global_id != -1) {
-        sprintf(sql+strlen(sql), "%u, ", _ref_global_id);
-    } else {
-        sprintf(sql+strlen(sql), "NULL, ");
+    for (const FormRecord::Bitmap& b: rec.bitmaps) {
+        add_bitmap(b);
+    }
+    for (const FormRecord::Letter& l: rec.letters) {
+        add_letter(l, form_id, djbz_id);
+    }
+    // only Djbz letters are referenced by other forms
+    if (rec.type != 2) {
+        for (const FormRecord::Letter& l: rec.letters) {
+            if (l.local_id != -1) {
+                m_letter_ids.erase(letter_key(form_id, l.local_id));
+            }
+        }
     }
 
-    sprintf(sql+strlen(sql), "%u, '%s'); ",
-            is_refinement, filename);
+    m_uncommitted_rows += 2 + rec.letters.size() + rec.bitmaps.size();
+    if (m_direct && m_uncommitted_rows >= DIRECT_COMMIT_ROWS) {
+        if (!exec("COMMIT TRANSACTION; BEGIN TRANSACTION; ", "add_form")) {
+            exit(3);
+        }
+        m_uncommitted_rows = 0;
+    }
+}
 
-    const int res = sqlite3_exec(m_storage, sql, nullptr, nullptr, &err);
-    if ( res != SQLITE_OK ) {
-        fprintf(stderr, _("Error in SQLStorage::add_letter():2 SQL exec: %d (%s)\n"), res, err);
-        sqlite3_free(err);
-        exit(3);
+void
+SQLStorage::checkpoint()
+{
+    if (m_direct && m_in_transaction && m_uncommitted_rows) {
+        if (!exec("COMMIT TRANSACTION; BEGIN TRANSACTION; ", "checkpoint")) {
+            exit(3);
+        }
+        m_uncommitted_rows = 0;
     }
 }
 
 void
 SQLStorage::save_on_disk()
 {
+    if (m_in_transaction) {
+        if (!exec("COMMIT TRANSACTION; ", "save_on_disk")) {
+            exit(3);
+        }
+        m_in_transaction = false;
+    }
+    if (!create_indexes()) {
+        exit(3);
+    }
+    if (m_direct) {
+        // move WAL content to the database file, so it's complete without -wal file
+        if (!exec("PRAGMA wal_checkpoint(TRUNCATE); ", "save_on_disk")) {
+            exit(3);
+        }
+        return;
+    }
+
     sqlite3_backup* backup = sqlite3_backup_init(m_storage_on_disk, "main", m_storage, "main");
     if (!backup) {
         fprintf(stderr, _("Error in SQLStorage::save_on_disk(): can't init backup object\n"));
@@ -327,3 +489,5 @@ SQLStorage::save_on_disk()
         exit(3);
     }
 }
+
+#endif // HAVE_LIBSQLITE3
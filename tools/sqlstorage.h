@@ -5,39 +5,68 @@
 
 #ifdef HAVE_LIBSQLITE3
 
+#include "formrecord.h"
 #include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
+// Rows are inserted with prepared statements in a transaction, which is
+// committed by save_on_disk(). Ids of forms and letters that may be referenced
+// later are kept in memory, so references are resolved without queries.
+// By default the database is built in memory and copied to disk at the end.
+// In direct mode it's written on disk in WAL mode with a commit every
+// DIRECT_COMMIT_ROWS rows, so memory use doesn't grow with the document
+// and committed rows survive a crash. Index is built after the bulk load.
 class SQLStorage
 {
 public:
+    enum { DIRECT_COMMIT_ROWS = 50000 };
+
     SQLStorage();
-    bool init(const char* filename);
+    bool init(const char* filename, bool direct = false, int cache_mb = 0);
+    // Opens the database of a previous run in direct mode, keeps rows of the
+    // forms at kept positions (references to them are resolved as if they were
+    // added by this run) and removes the rest.
+    bool resume(const char* filename, int cache_mb, const std::set<int>& kept);
+    // commits rows added so far, in direct mode
+    void checkpoint();
     void save_on_disk();
     ~SQLStorage();
 
-    void start_new_form(int position, const char* entry_name, const char* dump_path);
-    void start_new_sjbz(int w, int h, int version, int dpi);
-    void start_new_djbz();
-    void endof_form() { m_cur_form_id = -1; }
-    void endof_djbz() { m_cur_djbz_id = -1; }
-
-    void use_djbz(const char* entry_name);
-
-    void add_letter(int local_id, int x, int y, int w, int h,
-                    int to_image, int to_library, int is_non_symbol,
-                    int ref_local_id, int from_djbz,
-                    int is_refinement, const char* filename);
+    void add_form(int position, const char* entry_name, const char* dump_path, const FormRecord& rec);
 
 private:
-    bool open(const char* filename);
+    void add_letter(const FormRecord::Letter& l, sqlite3_int64 form_id, sqlite3_int64 djbz_id);
+    void add_bitmap(const FormRecord::Bitmap& b);
+    sqlite3_int64 letter_id(sqlite3_int64 form_id, int local_id) const;
+
+    bool open(const char* filename, int cache_mb);
     bool clear();
     bool create();
+    bool create_indexes();
+    bool has_tables();
+    bool load_ids();
+    bool prepare();
+    bool exec(const char* sql, const char* where);
+    void step(sqlite3_stmt* stmt, const char* where);
     void close();
 private:
     sqlite3 * m_storage;
     sqlite3 * m_storage_on_disk;
-    int m_cur_form_id;
-    int m_cur_djbz_id;
+    sqlite3_stmt* m_insert_form;
+    sqlite3_stmt* m_insert_sjbz;
+    sqlite3_stmt* m_insert_letter;
+    sqlite3_stmt* m_insert_bitmap;
+    bool m_in_transaction;
+    bool m_direct;
+    int m_uncommitted_rows;
+
+    std::unordered_map<std::string, sqlite3_int64> m_form_ids; // by entry name
+    std::unordered_map<unsigned long long, sqlite3_int64> m_letter_ids; // by form id and local id
+    std::unordered_set<unsigned long long> m_bitmap_hashes; // stored bitmaps
 };
 
 #endif // HAVE_LIBSQLITE3
@@ -0,0 +1,74 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(int threads, int max_queue): m_max_queue(max_queue > 0 ? max_queue : 0), m_busy(0), m_stop(false)
+{
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        m_threads.push_back(std::thread(&WorkerPool::run, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_has_task.notify_all();
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        m_threads[i].join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_max_queue) {
+            m_has_room.wait(lock, [this] { return m_queue.size() < m_max_queue; });
+        }
+        m_queue.push_back(task);
+    }
+    m_has_task.notify_one();
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this] { return m_queue.empty() && !m_busy; });
+}
+
+int WorkerPool::hardwareThreads()
+{
+    const int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+void WorkerPool::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_has_task.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty()) {
+            return; // m_stop
+        }
+        std::function<void()> task = m_queue.front();
+        m_queue.pop_front();
+        m_busy++;
+        lock.unlock();
+        if (m_max_queue) {
+            m_has_room.notify_one();
+        }
+
+        task();
+
+        lock.lock();
+        m_busy--;
+        if (m_queue.empty() && !m_busy) {
+            m_idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Fixed-size pool of threads executing submitted tasks in FIFO order.
+// Tasks may submit new tasks. If max_queue is set, submit() blocks while
+// the queue is full (don't use it for pools which tasks submit tasks).
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int threads, int max_queue = 0);
+    ~WorkerPool();
+
+    void submit(std::function<void()> task);
+    // blocks until queue is empty and all workers are idle
+    void wait();
+
+    // number of workers for "auto" setting
+    static int hardwareThreads();
+private:
+    void run();
+
+    std::vector<std::thread> m_threads;
+    std::deque< std::function<void()> > m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_has_task;
+    std::condition_variable m_has_room;
+    std::condition_variable m_idle;
+    size_t m_max_queue;
+    int m_busy;
+    bool m_stop;
+};
+
+#endif // WORKERPOOL_H
@@ -0,0 +1,21 @@
+#ifndef ZPSTREAM_H
+#define ZPSTREAM_H
+
+#include "../src/jb2/zp.h"
+
+// ZP decoders still read through stdio. ZPDecoder of minidjvu-mod takes
+// a FILE* and its reading is in zp.cpp, so DjVuDocument::openStream() gives
+// a fmemopen() stream over the mapped or loaded document; every stream has
+// its own cursor, so threads don't share one. Without fmemopen (Windows)
+// the file is reopened and seeked instead.
+
+// Bytes of a ZP stream of length bytes read by the decoder so far. This
+// includes the 2 bytes of the code register and up to 4 bytes preloaded to
+// the buffer. Past the end of the stream the decoder loads 0xff bytes that
+// aren't read, they aren't counted here (bytes_left stays 0).
+static inline int32 zp_consumed_bytes(const ZPDecoder& zp, int32 length)
+{
+    return length - zp.get_bytes_left();
+}
+
+#endif // ZPSTREAM_H